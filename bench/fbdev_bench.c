@@ -0,0 +1,307 @@
+/**
+ * @file fbdev_bench.c
+ *
+ * Flush throughput of the fbdev driver on a fake framebuffer (memfd or regular file),
+ * so the copy paths can be measured on machines without /dev/fb0.
+ *
+ * Usage: fbdev_bench [-x xres] [-y yres] [-l line_length] [-p line_padding] [-n frames] [-f file]
+ *
+ * For every framebuffer depth (1, 8, 16, 24 and 32bpp) it replays full screen, small widget
+ * and scrolling band damage with plain memcpy and with non-temporal stores (FBDEV_COPY_STREAM)
+ * and prints MB/s, ns per pixel and the p50/p99 flush latency.
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+/*The driver is built in with its own configuration, independent of lv_drv_conf.h*/
+#define LV_DRV_NO_CONF
+#define USE_FBDEV           1
+#define FBDEV_FLUSH_STATS   1
+#ifndef FBDEV_BUFFER_COUNT
+#define FBDEV_BUFFER_COUNT  1
+#endif
+
+#include "../display/fbdev.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/mman.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+/*Size of a widget redrawn by the widget pattern*/
+#define BENCH_WIDGET_W  48
+#define BENCH_WIDGET_H  32
+
+/*Widgets redrawn per frame*/
+#define BENCH_WIDGET_CNT  16
+
+/*Height of a band of the scrolling pattern in 1/16 of the screen*/
+#define BENCH_BAND_H  3
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+typedef enum {
+    BENCH_FULL,     /*The whole screen in one area*/
+    BENCH_WIDGETS,  /*Small areas at random places*/
+    BENCH_SCROLL,   /*Full width bands moving down the screen*/
+    _BENCH_PATTERN_CNT
+} bench_pattern_t;
+
+typedef struct {
+    uint32_t xres;
+    uint32_t yres;
+    uint32_t line_length;   /*0: packed rows*/
+    uint32_t line_padding;  /*Bytes added to packed rows*/
+    uint32_t frames;
+    const char * path;      /*NULL: memfd*/
+} bench_opts_t;
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+static int bench_open(const bench_opts_t * opts);
+static uint32_t bench_frame_areas(bench_pattern_t pattern, uint32_t frame, uint32_t xres, uint32_t yres,
+                                  lv_area_t * areas);
+static int bench_cmp_u32(const void * a, const void * b);
+static void bench_run(const bench_opts_t * opts, uint32_t bpp, bench_pattern_t pattern, fbdev_copy_mode_t mode,
+                      lv_color_t * src);
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+static const uint32_t bench_bpps[] = {1, 8, 16, 24, 32};
+static const char * const bench_pattern_names[] = {"full", "widgets", "scroll"};
+static const char * const bench_mode_names[] = {"memcpy", "stream"};
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+
+int main(int argc, char ** argv)
+{
+    bench_opts_t opts = {800, 480, 0, 0, 200, NULL};
+    int c;
+
+    while((c = getopt(argc, argv, "x:y:l:p:n:f:h")) != -1) {
+        switch(c) {
+            case 'x':
+                opts.xres = strtoul(optarg, NULL, 0);
+                break;
+            case 'y':
+                opts.yres = strtoul(optarg, NULL, 0);
+                break;
+            case 'l':
+                opts.line_length = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                opts.line_padding = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                opts.frames = strtoul(optarg, NULL, 0);
+                break;
+            case 'f':
+                opts.path = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-x xres] [-y yres] [-l line_length] [-p line_padding] [-n frames] "
+                        "[-f file]\n", argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if(opts.xres == 0 || opts.yres == 0 || opts.frames == 0) {
+        fprintf(stderr, "The resolution and the number of frames must not be 0\n");
+        return 1;
+    }
+
+    lv_init();
+
+    lv_color_t * src = malloc((size_t)opts.xres * opts.yres * sizeof(lv_color_t));
+    if(src == NULL) {
+        fprintf(stderr, "Cannot allocate the source buffer\n");
+        return 1;
+    }
+
+    /*Random pixels, so that nothing is faster because the data is uniform*/
+    uint8_t * src8 = (uint8_t *)src;
+    size_t i;
+    srand(1);
+    for(i = 0; i < (size_t)opts.xres * opts.yres * sizeof(lv_color_t); i++) src8[i] = rand();
+
+    printf("%ux%u, LV_COLOR_DEPTH %d, %u frames per pattern\n", opts.xres, opts.yres, LV_COLOR_DEPTH, opts.frames);
+    printf("%4s %6s %-8s %-6s %8s %9s %8s %8s %8s %8s\n",
+           "bpp", "stride", "pattern", "mode", "flushes", "MB/s", "ns/px", "p50 us", "p99 us", "max us");
+
+    for(i = 0; i < sizeof(bench_bpps) / sizeof(bench_bpps[0]); i++) {
+        bench_pattern_t p;
+        for(p = 0; p < _BENCH_PATTERN_CNT; p++) {
+            bench_run(&opts, bench_bpps[i], p, FBDEV_COPY_MEMCPY, src);
+            bench_run(&opts, bench_bpps[i], p, FBDEV_COPY_STREAM, src);
+        }
+    }
+
+    free(src);
+    return 0;
+}
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+
+/**
+ * Create the file to use as framebuffer.
+ * @param opts options of the benchmark
+ * @return file descriptor or -1
+ */
+static int bench_open(const bench_opts_t * opts)
+{
+    int fd;
+
+    if(opts->path) {
+        fd = open(opts->path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    }
+    else {
+        fd = memfd_create("fbdev_bench", 0);
+    }
+
+    if(fd == -1) perror("Error: cannot create the fake framebuffer");
+    return fd;
+}
+
+/**
+ * Get the areas a pattern flushes in a frame.
+ * @param pattern the damage pattern
+ * @param frame number of the frame
+ * @param xres horizontal resolution
+ * @param yres vertical resolution
+ * @param areas the areas are stored here, at least BENCH_WIDGET_CNT
+ * @return number of areas
+ */
+static uint32_t bench_frame_areas(bench_pattern_t pattern, uint32_t frame, uint32_t xres, uint32_t yres,
+                                  lv_area_t * areas)
+{
+    uint32_t i;
+
+    switch(pattern) {
+        case BENCH_FULL:
+            lv_area_set(&areas[0], 0, 0, xres - 1, yres - 1);
+            return 1;
+
+        case BENCH_WIDGETS:
+            for(i = 0; i < BENCH_WIDGET_CNT; i++) {
+                lv_coord_t x = xres > BENCH_WIDGET_W ? rand() % (xres - BENCH_WIDGET_W + 1) : 0;
+                lv_coord_t y = yres > BENCH_WIDGET_H ? rand() % (yres - BENCH_WIDGET_H + 1) : 0;
+                lv_area_set(&areas[i], x, y, LV_MIN(x + BENCH_WIDGET_W, (lv_coord_t)xres) - 1,
+                            LV_MIN(y + BENCH_WIDGET_H, (lv_coord_t)yres) - 1);
+            }
+            return BENCH_WIDGET_CNT;
+
+        case BENCH_SCROLL: {
+                uint32_t band_h = LV_MAX(yres * BENCH_BAND_H / 16, 1);
+                uint32_t y = (frame * 8) % yres;
+                lv_area_set(&areas[0], 0, y, xres - 1, LV_MIN(y + band_h, yres) - 1);
+                return 1;
+            }
+
+        default:
+            return 0;
+    }
+}
+
+static int bench_cmp_u32(const void * a, const void * b)
+{
+    uint32_t va = *(const uint32_t *)a;
+    uint32_t vb = *(const uint32_t *)b;
+    return va < vb ? -1 : va > vb;
+}
+
+/**
+ * Replay a damage pattern on a fake framebuffer and print the results.
+ * @param opts options of the benchmark
+ * @param bpp bits per pixel of the framebuffer
+ * @param pattern the damage pattern
+ * @param mode how the pixels are written into the framebuffer
+ * @param src a screen of pixels to flush from
+ */
+static void bench_run(const bench_opts_t * opts, uint32_t bpp, bench_pattern_t pattern, fbdev_copy_mode_t mode,
+                      lv_color_t * src)
+{
+    static fbdev_device_t dsc;
+    static lv_disp_draw_buf_t draw_buf;
+    lv_disp_drv_t drv;
+    lv_area_t areas[BENCH_WIDGET_CNT];
+    uint32_t line_length = opts->line_length;
+
+    if(line_length == 0) line_length = DIV_ROUND_UP(opts->xres * bpp, 8) + opts->line_padding;
+    if(line_length < DIV_ROUND_UP(opts->xres * bpp, 8)) {
+        printf("%4u %6u %-8s %-6s skipped, the line length is too small\n", bpp, line_length,
+               bench_pattern_names[pattern], bench_mode_names[mode]);
+        return;
+    }
+
+    int fd = bench_open(opts);
+    if(fd == -1) return;
+
+    fbdev_device_init(&dsc);
+    if(!fbdev_device_set_fake_file(&dsc, fd, opts->xres, opts->yres, bpp, line_length)) {
+        fbdev_device_exit(&dsc);
+        return;
+    }
+    fbdev_device_set_copy_mode(&dsc, mode);
+
+    /*Only `fbdev_flush()` is measured, it doesn't need a registered display*/
+    lv_memset(&drv, 0, sizeof(drv));
+    lv_memset(&draw_buf, 0, sizeof(draw_buf));
+    drv.hor_res = opts->xres;
+    drv.ver_res = opts->yres;
+    drv.draw_buf = &draw_buf;
+    drv.user_data = &dsc;
+
+    uint32_t max_flushes = opts->frames * BENCH_WIDGET_CNT;
+    uint32_t * lat = malloc(max_flushes * sizeof(uint32_t));
+    uint32_t flush_cnt = 0;
+    uint32_t frame;
+
+    if(lat == NULL) {
+        fprintf(stderr, "Cannot allocate the latency buffer\n");
+        fbdev_device_exit(&dsc);
+        return;
+    }
+
+    srand(2);
+    fbdev_device_reset_flush_stats(&dsc);
+    for(frame = 0; frame < opts->frames; frame++) {
+        uint32_t cnt = bench_frame_areas(pattern, frame, opts->xres, opts->yres, areas);
+        uint32_t a;
+        for(a = 0; a < cnt; a++) {
+            /*Every area starts at the top left of the source, like LVGL's draw buffer*/
+            uint64_t t = fbdev_time_ns();
+            draw_buf.flushing = 1;
+            draw_buf.flushing_last = a == cnt - 1;
+            fbdev_flush(&drv, &areas[a], src);
+            t = fbdev_time_ns() - t;
+            lat[flush_cnt++] = t > UINT32_MAX ? UINT32_MAX : (uint32_t)t;
+        }
+    }
+
+    fbdev_flush_stats_t stats;
+    fbdev_device_get_flush_stats(&dsc, &stats);
+    qsort(lat, flush_cnt, sizeof(uint32_t), bench_cmp_u32);
+
+    printf("%4u %6u %-8s %-6s %8u %9.1f %8.3f %8.1f %8.1f %8.1f\n", bpp, line_length, bench_pattern_names[pattern],
+           bench_mode_names[mode], stats.flush_cnt,
+           stats.time_ns ? (double)stats.byte_cnt * 1000.0 / stats.time_ns : 0.0,
+           stats.px_cnt ? (double)stats.time_ns / stats.px_cnt : 0.0,
+           lat[(flush_cnt - 1) * 50 / 100] / 1000.0,
+           lat[(flush_cnt - 1) * 99 / 100] / 1000.0,
+           lat[flush_cnt - 1] / 1000.0);
+
+    free(lat);
+    fbdev_device_exit(&dsc);
+}
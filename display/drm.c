@@ -16,21 +16,112 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <time.h>
 #include <unistd.h>
+#include <linux/netlink.h>
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 #include <drm_fourcc.h>
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DRM_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define DRM_SSE2 1
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#define DRM_SSSE3_DISPATCH 1
+#endif
+#endif
+
 #define DBG_TAG "drm"
 
 #define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
 
+#ifndef DRM_DAMAGE_CLIPS
+#define DRM_DAMAGE_CLIPS 16
+#endif
+
+#ifndef DRM_BUFFER_COUNT
+#define DRM_BUFFER_COUNT 2
+#endif
+
+#if DRM_BUFFER_COUNT < 2
+#error "DRM_BUFFER_COUNT must be at least 2"
+#endif
+
+#ifndef DRM_SHADOW_BUFFER
+#define DRM_SHADOW_BUFFER 0
+#endif
+
+/* Render resolution in percent of the mode, the plane (or the driver) upscales */
+#ifndef DRM_RENDER_SCALE
+#define DRM_RENDER_SCALE 100
+#endif
+
+/* Rotation of the screen: 0, 90, 180 or 270 degrees, by the plane if it can */
+#ifndef DRM_ROTATION
+#define DRM_ROTATION 0
+#endif
+
+/* Frames are scheduled to be ready this long before the vblank */
+#ifndef DRM_VBLANK_MARGIN_US
+#define DRM_VBLANK_MARGIN_US 1000
+#endif
+
+#ifndef DRM_MAX_OUTPUTS
+#define DRM_MAX_OUTPUTS 4
+#endif
+
+/* Follow monitors being plugged, unplugged and replaced, see drm_handle_hotplug() */
+#ifndef DRM_HOTPLUG
+#define DRM_HOTPLUG 0
+#endif
+
+#if DRM_CAPTURE
+/* Frames the display engine can write back at the same time */
+#define DRM_CAPTURE_BUFFERS 2
+
+#ifndef DRM_CLIENT_CAP_WRITEBACK_CONNECTORS
+#define DRM_CLIENT_CAP_WRITEBACK_CONNECTORS 5
+#endif
+
+#ifndef DRM_MODE_CONNECTOR_WRITEBACK
+#define DRM_MODE_CONNECTOR_WRITEBACK 18
+#endif
+#endif
+
+#if DRM_MAX_LAYERS > 0
+/* A layer's frames replace each other, two buffers are enough */
+#define DRM_LAYER_BUFFERS 2
+#endif
+
+/* Number of flushed areas kept to bring older buffers up to date */
+#ifndef DRM_DMG_CACHE_CAPACITY
+#define DRM_DMG_CACHE_CAPACITY 32
+#endif
+
 #define print(msg, ...)	fprintf(stderr, msg, ##__VA_ARGS__);
 #define err(msg, ...)  print("error: " msg "\n", ##__VA_ARGS__)
 #define info(msg, ...) print(msg "\n", ##__VA_ARGS__)
 #define dbg(msg, ...)  {} //print(DBG_TAG ": " msg "\n", ##__VA_ARGS__)
 
+/* Convert a row of px_cnt pixels, the rows needn't be aligned */
+typedef void (*drm_px_conv_t)(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt);
+
+enum drm_buffer_state {
+	DRM_BUF_FREE,
+	DRM_BUF_RENDERING, /* LVGL draws into it */
+	DRM_BUF_QUEUED,    /* Rendered, waits for the pending flip */
+	DRM_BUF_FLIPPING,  /* Committed, shown from the next vblank */
+	DRM_BUF_SCANOUT,   /* Shown now */
+};
+
 struct drm_buffer {
 	uint32_t handle;
 	uint32_t pitch;
@@ -38,747 +129,3740 @@ struct drm_buffer {
 	unsigned long int size;
 	uint8_t * map;
 	uint32_t fb_handle;
+	enum drm_buffer_state state;
+	uint32_t frame; /* Last frame rendered into it, 0 if none */
+#if DRM_FLIP_STATS
+	drm_flip_record_t rec; /* Timestamps of the frame in it */
+#endif
 };
 
-struct drm_dev {
-	int fd;
-	uint32_t conn_id, enc_id, crtc_id, plane_id, crtc_idx;
+/* Properties used in atomic commits, looked up once per object */
+enum drm_prop {
+	/* Plane */
+	DRM_PROP_FB_ID,
+	DRM_PROP_CRTC_ID, /* also on connectors */
+	DRM_PROP_SRC_X,
+	DRM_PROP_SRC_Y,
+	DRM_PROP_SRC_W,
+	DRM_PROP_SRC_H,
+	DRM_PROP_CRTC_X,
+	DRM_PROP_CRTC_Y,
+	DRM_PROP_CRTC_W,
+	DRM_PROP_CRTC_H,
+	DRM_PROP_FB_DAMAGE_CLIPS,
+	DRM_PROP_ROTATION,
+	DRM_PROP_ZPOS,
+	/* CRTC */
+	DRM_PROP_MODE_ID,
+	DRM_PROP_ACTIVE,
+	/* Writeback connectors */
+	DRM_PROP_WRITEBACK_FB_ID,
+	DRM_PROP_WRITEBACK_OUT_FENCE_PTR,
+	DRM_PROP_CNT
+};
+
+static const char * const drm_prop_names[DRM_PROP_CNT] = {
+	[DRM_PROP_FB_ID] = "FB_ID",
+	[DRM_PROP_CRTC_ID] = "CRTC_ID",
+	[DRM_PROP_SRC_X] = "SRC_X",
+	[DRM_PROP_SRC_Y] = "SRC_Y",
+	[DRM_PROP_SRC_W] = "SRC_W",
+	[DRM_PROP_SRC_H] = "SRC_H",
+	[DRM_PROP_CRTC_X] = "CRTC_X",
+	[DRM_PROP_CRTC_Y] = "CRTC_Y",
+	[DRM_PROP_CRTC_W] = "CRTC_W",
+	[DRM_PROP_CRTC_H] = "CRTC_H",
+	[DRM_PROP_FB_DAMAGE_CLIPS] = "FB_DAMAGE_CLIPS",
+	[DRM_PROP_ROTATION] = "rotation",
+	[DRM_PROP_ZPOS] = "zpos",
+	[DRM_PROP_MODE_ID] = "MODE_ID",
+	[DRM_PROP_ACTIVE] = "ACTIVE",
+	[DRM_PROP_WRITEBACK_FB_ID] = "WRITEBACK_FB_ID",
+	[DRM_PROP_WRITEBACK_OUT_FENCE_PTR] = "WRITEBACK_OUT_FENCE_PTR",
+};
+
+struct drm_object {
+	uint32_t id;
+	uint32_t type;
+	uint32_t prop_ids[DRM_PROP_CNT]; /* 0 if the object doesn't have the property */
+	uint64_t values[DRM_PROP_CNT];   /* Last values added to a commit */
+	uint32_t committed;              /* Properties whose value the kernel has */
+	uint32_t pending;                /* Properties added since the last commit */
+};
+
+#if DRM_CAPTURE
+/* Writeback connector attached to the CRTC of an output */
+struct drm_capture {
+	struct drm_object obj; /* Id 0 until a writeback connector is found */
+	bool active;           /* Attached with the next commit, detached once stopped */
+	struct drm_buffer bufs[DRM_CAPTURE_BUFFERS];
+	int32_t fence[DRM_CAPTURE_BUFFERS]; /* Signalled once the frame is written, -1 if the buffer is free */
+	uint32_t frame[DRM_CAPTURE_BUFFERS];
+	uint32_t interval;     /* Capture every interval-th frame, 0: only when asked */
+	bool next;             /* Capture the next frame */
+	drm_capture_cb_t cb;
+	char *path;            /* PPM file name format if there is no callback */
+	void *user_data;
+};
+#endif
+
+#if DRM_MAX_LAYERS > 0
+/* An LVGL display on an overlay plane, committed with its output */
+struct drm_layer {
+	struct drm_output *out; /* NULL if unused */
+	uint32_t plane_id;
+	struct drm_object obj;
+	uint32_t fourcc;
+	int32_t x, y;           /* Position on the CRTC */
 	uint32_t width, height;
+	uint32_t zpos;
+	bool visible;
+	bool dirty;             /* Position or visibility not committed yet */
+	struct drm_buffer bufs[DRM_LAYER_BUFFERS];
+	lv_area_t stale[DRM_LAYER_BUFFERS]; /* Bounding box of the areas a buffer misses */
+	uint8_t *shadow;        /* LVGL renders here, it always has the last frame */
+	lv_area_t frame_area;   /* Flushed in the current frame */
+	uint32_t frame;         /* Number of the last rendered frame */
+	lv_disp_draw_buf_t draw_buf;
+	lv_disp_drv_t disp_drv;
+};
+#endif
+
+/* One connector with its CRTC, primary plane and buffers */
+struct drm_output {
+	uint32_t conn_id, enc_id, crtc_id, plane_id, crtc_idx;
+	uint32_t width, height;       /* Render resolution LVGL draws at, rotated */
+	uint32_t fb_width, fb_height; /* Size of the dumb buffers */
 	uint32_t mmWidth, mmHeight;
 	uint32_t fourcc;
+	uint32_t bpp;                 /* Of the buffers, LV_COLOR_DEPTH unless converted */
+	drm_px_conv_t px_conv;        /* Converts LVGL's pixels into the buffers' format, NULL if they match */
 	drmModeModeInfo mode;
 	uint32_t blob_id;
 	drmModeCrtc *saved_crtc;
-	drmModeAtomicReq *req;
-	drmEventContext drm_event_ctx;
+	drmModeAtomicReq *req; /* Reused for every commit */
+	bool modeset_done;
+	bool flip_pending;
+	bool disconnected; /*The monitor is gone, frames are dropped until it is back*/
 	drmModePlane *plane;
 	drmModeCrtc *crtc;
 	drmModeConnector *conn;
-	uint32_t count_plane_props;
-	uint32_t count_crtc_props;
-	uint32_t count_conn_props;
-	drmModePropertyPtr plane_props[128];
-	drmModePropertyPtr crtc_props[128];
-	drmModePropertyPtr conn_props[128];
-	struct drm_buffer drm_bufs[2]; /*DUMB buffers*/
-	uint8_t active_drm_buf_idx; /*Double buffering handling*/
+	struct drm_object plane_obj;
+	struct drm_object crtc_obj;
+	struct drm_object conn_obj;
+	struct drm_buffer drm_bufs[DRM_BUFFER_COUNT]; /*DUMB buffers*/
+	int render_idx; /*Buffer LVGL renders into, -1 while waiting for a free one*/
+	int last_idx;   /*Buffer of the last rendered frame*/
+	uint32_t frame; /*Number of the last rendered frame*/
+	struct {
+		lv_area_t cache[DRM_DMG_CACHE_CAPACITY];
+		uint32_t frame[DRM_DMG_CACHE_CAPACITY]; /*Frame each area was flushed in*/
+		uint32_t start;
+		uint32_t size;
+		uint32_t lost; /*Newest frame with areas dropped from a full cache*/
+	} dmg_cache;
+	lv_disp_rot_t rotation;
+	uint64_t plane_rotation; /*Value of the plane's rotation property*/
+	uint8_t *shadow; /*Cached buffer LVGL renders into with DRM_SHADOW_BUFFER, sw_transform or px_conv*/
+	bool sw_transform; /*The plane can't scale or rotate, the shadow is copied into mode sized buffers*/
+	int32_t *map_col;     /*Shadow pixel offset of every buffer column...*/
+	int32_t *map_row;     /*...plus the one of every buffer row*/
+	lv_color_t *map_line; /*One transformed row, repeated for the rows it covers*/
+	uint8_t *conv_line;   /*The same row converted with px_conv*/
 	lv_disp_draw_buf_t draw_buf;
-} drm_dev;
-
-static uint32_t get_plane_property_id(const char *name)
-{
-	uint32_t i;
-
-	dbg("Find plane property: %s", name);
+#if DRM_DAMAGE_CLIPS > 0
+	struct drm_mode_rect damage[DRM_DAMAGE_CLIPS]; /*Areas flushed in the current frame*/
+	uint32_t damage_cnt;
+#endif
+	lv_disp_drv_t disp_drv; /*Used by drm_output_create_disp()*/
+	lv_disp_drv_t *drv;     /*Driver set up by drm_output_disp_drv_init(), updated on mode changes*/
+	uint64_t vblank_ns;    /*Time of the last flip, 0 before the first one*/
+	uint32_t vblank_seq;
+	uint64_t period_ns;    /*Refresh period: from the mode, then measured*/
+	uint64_t render_ns;    /*Average time from waking up to the last flush*/
+	uint64_t render_start; /*Wake up time given by drm_output_get_sleep_us()*/
+	struct {
+		bool ready;    /* Set up by the first drm_output_set_cursor() */
+		uint32_t plane_id; /* 0: use the legacy cursor ioctls */
+		struct drm_object obj;
+		struct drm_buffer buf;
+		uint32_t width, height;
+		lv_coord_t x, y;
+		lv_coord_t hot_x, hot_y;
+		bool visible;
+		bool dirty;    /* Position or image not committed yet */
+	} cursor;
+#if DRM_MAX_LAYERS > 0
+	struct drm_layer layers[DRM_MAX_LAYERS];
+#endif
+#if DRM_CAPTURE
+	struct drm_capture capture;
+#endif
+#if DRM_FLIP_STATS
+	drm_flip_stats_t stats;
+	uint32_t flip_seq_delta; /*Vblanks between the last two flips*/
+#if DRM_FLIP_LOG > 0
+	drm_flip_record_t log[DRM_FLIP_LOG]; /*Ring of the last shown frames*/
+	uint32_t log_cnt; /*Records written since the last reset*/
+#endif
+#endif
+};
 
-	for (i = 0; i < drm_dev.count_plane_props; ++i)
-		if (!strcmp(drm_dev.plane_props[i]->name, name))
-			return drm_dev.plane_props[i]->prop_id;
+struct drm_dev {
+	int fd;
+	bool monotonic; /*Flip timestamps are CLOCK_MONOTONIC*/
+	drmEventContext drm_event_ctx;
+	struct drm_output outputs[DRM_MAX_OUTPUTS];
+	uint32_t output_cnt;
+#if DRM_HOTPLUG
+	unsigned int minor; /*Device minor number, tells our uevents*/
+	int uevent_fd;      /*Kernel uevent netlink socket, -1 if not open*/
+	lv_timer_t *hotplug_timer;
+#endif
+} drm_dev;
 
-	dbg("Unknown plane property: %s", name);
+static void drm_flip_done(struct drm_output *out);
 
-	return 0;
+static uint64_t drm_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static uint32_t get_crtc_property_id(const char *name)
+#if DRM_FLIP_STATS
+static uint32_t drm_ns32(uint64_t ns)
 {
-	uint32_t i;
-
-	dbg("Find crtc property: %s", name);
-
-	for (i = 0; i < drm_dev.count_crtc_props; ++i)
-		if (!strcmp(drm_dev.crtc_props[i]->name, name))
-			return drm_dev.crtc_props[i]->prop_id;
-
-	dbg("Unknown crtc property: %s", name);
-
-	return 0;
+	return ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns;
 }
+#endif
 
-static uint32_t get_conn_property_id(const char *name)
+/*
+ * Track the vblanks: the flip happened at the start of one. The period is
+ * averaged over the flips to follow the real clock of the display.
+ */
+static void drm_vblank_update(struct drm_output *out, uint32_t sequence, uint64_t ns)
 {
-	uint32_t i;
-
-	dbg("Find conn property: %s", name);
+	uint32_t frames = sequence - out->vblank_seq;
 
-	for (i = 0; i < drm_dev.count_conn_props; ++i)
-		if (!strcmp(drm_dev.conn_props[i]->name, name))
-			return drm_dev.conn_props[i]->prop_id;
-
-	dbg("Unknown conn property: %s", name);
+	if (out->vblank_ns && frames > 0 && frames < 16 && ns > out->vblank_ns) {
+		uint64_t period = (ns - out->vblank_ns) / frames;
+		/* Ignore timestamps off by more than 1/8 of a period */
+		if (period > out->period_ns - out->period_ns / 8 && period < out->period_ns + out->period_ns / 8)
+			out->period_ns = (out->period_ns * 7 + period) / 8;
+	}
 
-	return 0;
+#if DRM_FLIP_STATS
+	out->flip_seq_delta = out->vblank_ns ? frames : 0;
+#endif
+	out->vblank_ns = ns;
+	out->vblank_seq = sequence;
 }
 
 static void page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
 			      unsigned int tv_usec, void *user_data)
 {
 	LV_UNUSED(fd);
-	LV_UNUSED(sequence);
-	LV_UNUSED(tv_sec);
-	LV_UNUSED(tv_usec);
-	LV_UNUSED(user_data);
 
 	dbg("flip");
 
-	if(drm_dev.req) {
-		drmModeAtomicFree(drm_dev.req);
-		drm_dev.req = NULL;
-	}
+	/* Every output commits with itself as user data */
+	drm_vblank_update(user_data, sequence, (uint64_t)tv_sec * 1000000000 + (uint64_t)tv_usec * 1000);
+	drm_flip_done(user_data);
 }
 
-static int drm_get_plane_props(void)
+static int drm_object_init(struct drm_object *obj, uint32_t id, uint32_t type)
 {
 	uint32_t i;
+	int p;
+
+	lv_memset(obj, 0, sizeof(*obj));
+	obj->id = id;
+	obj->type = type;
 
-	drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(drm_dev.fd, drm_dev.plane_id,
-								      DRM_MODE_OBJECT_PLANE);
+	drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(drm_dev.fd, id, type);
 	if (!props) {
 		err("drmModeObjectGetProperties failed");
 		return -1;
 	}
-	dbg("Found %u plane props", props->count_props);
-	drm_dev.count_plane_props = props->count_props;
+	dbg("Found %u props of object %u", props->count_props, id);
 	for (i = 0; i < props->count_props; i++) {
-		drm_dev.plane_props[i] = drmModeGetProperty(drm_dev.fd, props->props[i]);
-		dbg("Added plane prop %u:%s", drm_dev.plane_props[i]->prop_id, drm_dev.plane_props[i]->name);
+		drmModePropertyPtr prop = drmModeGetProperty(drm_dev.fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		for (p = 0; p < DRM_PROP_CNT; p++) {
+			if (!strcmp(prop->name, drm_prop_names[p])) {
+				obj->prop_ids[p] = prop->prop_id;
+				dbg("Added prop %u:%s", prop->prop_id, prop->name);
+			}
+		}
+		drmModeFreeProperty(prop);
 	}
 	drmModeFreeObjectProperties(props);
 
 	return 0;
 }
 
-static int drm_get_crtc_props(void)
+/*
+ * Add a property to the next commit, unless the kernel has this value already.
+ */
+static int drm_object_set(drmModeAtomicReq *req, struct drm_object *obj, enum drm_prop prop, uint64_t value)
 {
-	uint32_t i;
+	int ret;
+	uint32_t bit = 1U << prop;
 
-	drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(drm_dev.fd, drm_dev.crtc_id,
-								      DRM_MODE_OBJECT_CRTC);
-	if (!props) {
-		err("drmModeObjectGetProperties failed");
+	if (!obj->prop_ids[prop]) {
+		err("Couldn't find prop %s of object %u", drm_prop_names[prop], obj->id);
 		return -1;
 	}
-	dbg("Found %u crtc props", props->count_props);
-	drm_dev.count_crtc_props = props->count_props;
-	for (i = 0; i < props->count_props; i++) {
-		drm_dev.crtc_props[i] = drmModeGetProperty(drm_dev.fd, props->props[i]);
-		dbg("Added crtc prop %u:%s", drm_dev.crtc_props[i]->prop_id, drm_dev.crtc_props[i]->name);
-	}
-	drmModeFreeObjectProperties(props);
 
-	return 0;
-}
-
-static int drm_get_conn_props(void)
-{
-	uint32_t i;
+	if ((obj->committed & bit) && obj->values[prop] == value)
+		return 0;
 
-	drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(drm_dev.fd, drm_dev.conn_id,
-								      DRM_MODE_OBJECT_CONNECTOR);
-	if (!props) {
-		err("drmModeObjectGetProperties failed");
-		return -1;
-	}
-	dbg("Found %u connector props", props->count_props);
-	drm_dev.count_conn_props = props->count_props;
-	for (i = 0; i < props->count_props; i++) {
-		drm_dev.conn_props[i] = drmModeGetProperty(drm_dev.fd, props->props[i]);
-		dbg("Added connector prop %u:%s", drm_dev.conn_props[i]->prop_id, drm_dev.conn_props[i]->name);
+	ret = drmModeAtomicAddProperty(req, obj->id, obj->prop_ids[prop], value);
+	if (ret < 0) {
+		err("drmModeAtomicAddProperty (%s:%" PRIu64 ") failed: %d", drm_prop_names[prop], value, ret);
+		return ret;
 	}
-	drmModeFreeObjectProperties(props);
+
+	obj->values[prop] = value;
+	obj->pending |= bit;
 
 	return 0;
 }
 
-static int drm_add_plane_property(const char *name, uint64_t value)
+/*
+ * Update the committed properties after a commit: on success the kernel has the
+ * pending values, otherwise nothing is known and every property is sent again.
+ */
+static void drm_object_commit_done(struct drm_object *obj, bool success)
 {
-	int ret;
-	uint32_t prop_id = get_plane_property_id(name);
+	if (success)
+		obj->committed |= obj->pending;
+	else
+		obj->committed = 0;
+	obj->pending = 0;
+}
 
-	if (!prop_id) {
-		err("Couldn't find plane prop %s", name);
-		return -1;
-	}
+static void drm_output_commit_done(struct drm_output *out, bool success)
+{
+	drm_object_commit_done(&out->conn_obj, success);
+	drm_object_commit_done(&out->crtc_obj, success);
+	drm_object_commit_done(&out->plane_obj, success);
+	/*
+	 * The damage doesn't persist: the kernel drops it with every new plane state,
+	 * also of commits without damage (modesets, cursor updates on some drivers),
+	 * and a recycled blob id would then look like the cached value.
+	 */
+	out->plane_obj.committed &= ~(1U << DRM_PROP_FB_DAMAGE_CLIPS);
+	drm_object_commit_done(&out->cursor.obj, success);
+#if DRM_MAX_LAYERS > 0
+	for (int i = 0; i < DRM_MAX_LAYERS; i++)
+		drm_object_commit_done(&out->layers[i].obj, success);
+#endif
+#if DRM_CAPTURE
+	drm_object_commit_done(&out->capture.obj, success);
+	/* A writeback job is used once, the kernel resets its properties */
+	out->capture.obj.committed &= ~(1U << DRM_PROP_WRITEBACK_FB_ID | 1U << DRM_PROP_WRITEBACK_OUT_FENCE_PTR);
+#endif
+}
 
-	ret = drmModeAtomicAddProperty(drm_dev.req, drm_dev.plane_id, get_plane_property_id(name), value);
-	if (ret < 0) {
-		err("drmModeAtomicAddProperty (%s:%" PRIu64 ") failed: %d", name, value, ret);
-		return ret;
-	}
+#if DRM_DAMAGE_CLIPS > 0
+static bool drm_rects_touch(const struct drm_mode_rect *a, const struct drm_mode_rect *b)
+{
+	return a->x1 <= b->x2 && b->x1 <= a->x2 && a->y1 <= b->y2 && b->y1 <= a->y2;
+}
 
-	return 0;
+static void drm_rect_join(struct drm_mode_rect *a, const struct drm_mode_rect *b)
+{
+	a->x1 = LV_MIN(a->x1, b->x1);
+	a->y1 = LV_MIN(a->y1, b->y1);
+	a->x2 = LV_MAX(a->x2, b->x2);
+	a->y2 = LV_MAX(a->y2, b->y2);
 }
 
-static int drm_add_crtc_property(const char *name, uint64_t value)
+/*
+ * Add a flushed area to the damage of the frame. Overlapping and adjacent
+ * rectangles are merged, if there are still too many all are merged into one.
+ */
+static void drm_damage_add(struct drm_output *out, const lv_area_t *area)
 {
-	int ret;
-	uint32_t prop_id = get_crtc_property_id(name);
+	struct drm_mode_rect r;
+	uint32_t i;
 
-	if (!prop_id) {
-		err("Couldn't find crtc prop %s", name);
-		return -1;
+	r.x1 = LV_MAX(area->x1, 0);
+	r.y1 = LV_MAX(area->y1, 0);
+	r.x2 = LV_MIN(area->x2 + 1, (int32_t)out->fb_width);
+	r.y2 = LV_MIN(area->y2 + 1, (int32_t)out->fb_height);
+	if (r.x1 >= r.x2 || r.y1 >= r.y2)
+		return;
+
+	/* The joined rectangle might touch rectangles checked before, so start over */
+	i = 0;
+	while (i < out->damage_cnt) {
+		if (drm_rects_touch(&out->damage[i], &r)) {
+			drm_rect_join(&r, &out->damage[i]);
+			out->damage[i] = out->damage[--out->damage_cnt];
+			i = 0;
+		} else {
+			i++;
+		}
 	}
 
-	ret = drmModeAtomicAddProperty(drm_dev.req, drm_dev.crtc_id, get_crtc_property_id(name), value);
-	if (ret < 0) {
-		err("drmModeAtomicAddProperty (%s:%" PRIu64 ") failed: %d", name, value, ret);
-		return ret;
+	if (out->damage_cnt == DRM_DAMAGE_CLIPS) {
+		for (i = 0; i < out->damage_cnt; i++)
+			drm_rect_join(&r, &out->damage[i]);
+		out->damage_cnt = 0;
 	}
 
-	return 0;
+	out->damage[out->damage_cnt++] = r;
 }
+#endif
 
-static int drm_add_conn_property(const char *name, uint64_t value)
-{
-	int ret;
-	uint32_t prop_id = get_conn_property_id(name);
+static void drm_cursor_add(struct drm_output *out);
+#if DRM_MAX_LAYERS > 0
+static bool drm_layers_pending(struct drm_output *out);
+static void drm_layers_add(struct drm_output *out);
+static void drm_layers_commit_done(struct drm_output *out, bool success);
+static void drm_layers_flip_done(struct drm_output *out);
+static void drm_layers_reset(struct drm_output *out);
+static void drm_layer_free(struct drm_layer *layer);
+#endif
+#if DRM_CAPTURE
+static bool drm_capture_attach(struct drm_output *out);
+static void drm_capture_add(struct drm_output *out, struct drm_buffer *buf);
+static void drm_capture_poll(struct drm_output *out, int timeout);
+static void drm_capture_free(struct drm_output *out);
+#endif
 
-	if (!prop_id) {
-		err("Couldn't find conn prop %s", name);
-		return -1;
-	}
+static void drm_modeset_add(struct drm_output *out)
+{
+	drm_object_set(out->req, &out->conn_obj, DRM_PROP_CRTC_ID, out->crtc_id);
 
-	ret = drmModeAtomicAddProperty(drm_dev.req, drm_dev.conn_id, get_conn_property_id(name), value);
-	if (ret < 0) {
-		err("drmModeAtomicAddProperty (%s:%" PRIu64 ") failed: %d", name, value, ret);
-		return ret;
-	}
+	drm_object_set(out->req, &out->crtc_obj, DRM_PROP_MODE_ID, out->blob_id);
+	drm_object_set(out->req, &out->crtc_obj, DRM_PROP_ACTIVE, 1);
+}
 
-	return 0;
+/*
+ * Show the whole buffer on the whole CRTC, scaled if the buffer is smaller.
+ * Only the changed properties are added, usually just FB_ID.
+ */
+static void drm_plane_add(struct drm_output *out, struct drm_buffer *buf)
+{
+	drm_object_set(out->req, &out->plane_obj, DRM_PROP_FB_ID, buf->fb_handle);
+	drm_object_set(out->req, &out->plane_obj, DRM_PROP_CRTC_ID, out->crtc_id);
+	drm_object_set(out->req, &out->plane_obj, DRM_PROP_SRC_X, 0);
+	drm_object_set(out->req, &out->plane_obj, DRM_PROP_SRC_Y, 0);
+	drm_object_set(out->req, &out->plane_obj, DRM_PROP_SRC_W, out->fb_width << 16);
+	drm_object_set(out->req, &out->plane_obj, DRM_PROP_SRC_H, out->fb_height << 16);
+	drm_object_set(out->req, &out->plane_obj, DRM_PROP_CRTC_X, 0);
+	drm_object_set(out->req, &out->plane_obj, DRM_PROP_CRTC_Y, 0);
+	drm_object_set(out->req, &out->plane_obj, DRM_PROP_CRTC_W, out->mode.hdisplay);
+	drm_object_set(out->req, &out->plane_obj, DRM_PROP_CRTC_H, out->mode.vdisplay);
+	if (out->plane_obj.prop_ids[DRM_PROP_ROTATION])
+		drm_object_set(out->req, &out->plane_obj, DRM_PROP_ROTATION, out->plane_rotation);
 }
 
-static int drm_dmabuf_set_plane(struct drm_buffer *buf)
+/*
+ * Commit a new frame, or with buf NULL only a cursor update.
+ */
+static int drm_dmabuf_set_plane(struct drm_output *out, struct drm_buffer *buf)
 {
 	int ret;
-	static int first = 1;
 	uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+	uint32_t damage_blob_id = 0;
+#if DRM_FLIP_STATS
+	uint64_t t_commit;
+#endif
 
-	drm_dev.req = drmModeAtomicAlloc();
+	drmModeAtomicSetCursor(out->req, 0);
 
 	/* On first Atomic commit, do a modeset */
-	if (first) {
-		drm_add_conn_property("CRTC_ID", drm_dev.crtc_id);
+	if (!out->modeset_done) {
+		drm_modeset_add(out);
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	}
 
-		drm_add_crtc_property("MODE_ID", drm_dev.blob_id);
-		drm_add_crtc_property("ACTIVE", 1);
+	drm_cursor_add(out);
+#if DRM_MAX_LAYERS > 0
+	drm_layers_add(out);
+#endif
 
+#if DRM_CAPTURE
+	/* Attaching or detaching the writeback connector is a modeset */
+	if (drm_capture_attach(out))
 		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+#endif
 
-		first = 0;
+	if (!buf)
+		goto commit;
+
+	drm_plane_add(out, buf);
+#if DRM_CAPTURE
+	drm_capture_add(out, buf);
+#endif
+
+#if DRM_DAMAGE_CLIPS > 0
+	/* Let the driver transfer only the changed areas (e.g. over USB or SPI) */
+	if (out->damage_cnt && out->plane_obj.prop_ids[DRM_PROP_FB_DAMAGE_CLIPS]) {
+		if (drmModeCreatePropertyBlob(drm_dev.fd, out->damage,
+					      out->damage_cnt * sizeof(struct drm_mode_rect),
+					      &damage_blob_id)) {
+			err("error creating damage blob");
+		} else {
+			drm_object_set(out->req, &out->plane_obj, DRM_PROP_FB_DAMAGE_CLIPS, damage_blob_id);
+		}
+	}
+	out->damage_cnt = 0;
+#endif
+
+commit:
+#if DRM_FLIP_STATS
+	t_commit = drm_time_ns();
+#endif
+	/* Outputs commit separately, the flip event tells which one is done */
+	ret = drmModeAtomicCommit(drm_dev.fd, out->req, flags, out);
+#if DRM_FLIP_STATS
+	if (buf) {
+		buf->rec.commit_ns = t_commit;
+		buf->rec.commit_dur_ns = drm_ns32(drm_time_ns() - t_commit);
 	}
+#endif
 
-	drm_add_plane_property("FB_ID", buf->fb_handle);
-	drm_add_plane_property("CRTC_ID", drm_dev.crtc_id);
-	drm_add_plane_property("SRC_X", 0);
-	drm_add_plane_property("SRC_Y", 0);
-	drm_add_plane_property("SRC_W", drm_dev.width << 16);
-	drm_add_plane_property("SRC_H", drm_dev.height << 16);
-	drm_add_plane_property("CRTC_X", 0);
-	drm_add_plane_property("CRTC_Y", 0);
-	drm_add_plane_property("CRTC_W", drm_dev.width);
-	drm_add_plane_property("CRTC_H", drm_dev.height);
+	/* The commit holds its own reference to the blob */
+	if (damage_blob_id)
+		drmModeDestroyPropertyBlob(drm_dev.fd, damage_blob_id);
+
+	drm_output_commit_done(out, ret == 0);
+#if DRM_MAX_LAYERS > 0
+	drm_layers_commit_done(out, ret == 0);
+#endif
 
-	ret = drmModeAtomicCommit(drm_dev.fd, drm_dev.req, flags, NULL);
 	if (ret) {
 		err("drmModeAtomicCommit failed: %s", strerror(errno));
-		drmModeAtomicFree(drm_dev.req);
 		return ret;
 	}
 
+	out->modeset_done = true;
+	out->flip_pending = true;
+	if (out->cursor.plane_id)
+		out->cursor.dirty = false;
+
 	return 0;
 }
 
-static int find_plane(unsigned int fourcc, uint32_t *plane_id, uint32_t crtc_id, uint32_t crtc_idx)
+/*
+ * Pixel conversion for planes which don't take the format LVGL renders.
+ * LVGL's XRGB8888 is 0xXXRRGGBB and its RGB565 0bRRRRRGGGGGGBBBBB, both
+ * little endian like the DRM formats. X (or A) is written as all ones.
+ */
+
+#if DRM_SSE2
+/* Swap red and blue of 4 XRGB8888 pixels */
+static inline __m128i px_sse2_swap_rb(__m128i c)
 {
-	LV_UNUSED(crtc_id);
-	drmModePlaneResPtr planes;
-	drmModePlanePtr plane;
-	unsigned int i;
-	unsigned int j;
-	int ret = 0;
-	unsigned int format = fourcc;
+	__m128i rb = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(c, 16), _mm_set1_epi32(0xFF)),
+				  _mm_slli_epi32(_mm_and_si128(c, _mm_set1_epi32(0xFF)), 16));
+	return _mm_or_si128(_mm_or_si128(_mm_and_si128(c, _mm_set1_epi32(0xFF00)), rb),
+			    _mm_set1_epi32((int)0xFF000000));
+}
+#endif
 
-	planes = drmModeGetPlaneResources(drm_dev.fd);
-	if (!planes) {
-		err("drmModeGetPlaneResources failed");
-		return -1;
-	}
+#if LV_COLOR_DEPTH == 32
 
-	dbg("drm: found planes %u", planes->count_planes);
+#if DRM_SSE2
+/* 4 XRGB8888 pixels to RGB565 or BGR565, sign extended in 32 bit lanes for _mm_packs_epi32 */
+static inline __m128i px_sse2_xrgb8888_to_565(__m128i c, bool bgr)
+{
+	__m128i r = _mm_and_si128(_mm_srli_epi32(c, 8), _mm_set1_epi32(0xF800));
+	__m128i g = _mm_and_si128(_mm_srli_epi32(c, 5), _mm_set1_epi32(0x07E0));
+	__m128i b = _mm_and_si128(_mm_srli_epi32(c, 3), _mm_set1_epi32(0x001F));
 
-	for (i = 0; i < planes->count_planes; ++i) {
-		plane = drmModeGetPlane(drm_dev.fd, planes->planes[i]);
-		if (!plane) {
-			err("drmModeGetPlane failed: %s", strerror(errno));
-			break;
-		}
+	if (bgr) {
+		r = _mm_and_si128(_mm_srli_epi32(c, 19), _mm_set1_epi32(0x001F));
+		b = _mm_and_si128(_mm_slli_epi32(c, 8), _mm_set1_epi32(0xF800));
+	}
+	c = _mm_or_si128(_mm_or_si128(r, g), b);
+	return _mm_srai_epi32(_mm_slli_epi32(c, 16), 16);
+}
+#endif
 
-		if (!(plane->possible_crtcs & (1 << crtc_idx))) {
-			drmModeFreePlane(plane);
-			continue;
-		}
+static void px_xrgb8888_to_argb8888(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	const uint32_t *src32 = (const uint32_t *)src;
+	uint32_t *dst32 = (uint32_t *)dst;
+	uint32_t i = 0;
+
+#if DRM_NEON
+	for (; i + 4 <= px_cnt; i += 4)
+		vst1q_u32(dst32 + i, vorrq_u32(vld1q_u32(src32 + i), vdupq_n_u32(0xFF000000)));
+#elif DRM_SSE2
+	for (; i + 4 <= px_cnt; i += 4)
+		_mm_storeu_si128((__m128i *)(dst32 + i),
+				 _mm_or_si128(_mm_loadu_si128((const __m128i *)(src32 + i)),
+					      _mm_set1_epi32((int)0xFF000000)));
+#endif
 
-		for (j = 0; j < plane->count_formats; ++j) {
-			if (plane->formats[j] == format)
-				break;
-		}
+	for (; i < px_cnt; i++)
+		dst32[i] = src32[i] | 0xFF000000;
+}
 
-		if (j == plane->count_formats) {
-			drmModeFreePlane(plane);
-			continue;
-		}
+static void px_xrgb8888_to_xbgr8888(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	const uint32_t *src32 = (const uint32_t *)src;
+	uint32_t *dst32 = (uint32_t *)dst;
+	uint32_t i = 0;
+
+#if DRM_NEON
+	for (; i + 16 <= px_cnt; i += 16) {
+		uint8x16x4_t px = vld4q_u8((const uint8_t *)(src32 + i));
+		uint8x16_t b = px.val[0];
+		px.val[0] = px.val[2];
+		px.val[2] = b;
+		px.val[3] = vdupq_n_u8(0xFF);
+		vst4q_u8((uint8_t *)(dst32 + i), px);
+	}
+#elif DRM_SSE2
+	for (; i + 4 <= px_cnt; i += 4)
+		_mm_storeu_si128((__m128i *)(dst32 + i),
+				 px_sse2_swap_rb(_mm_loadu_si128((const __m128i *)(src32 + i))));
+#endif
 
-		*plane_id = plane->plane_id;
-		drmModeFreePlane(plane);
+	for (; i < px_cnt; i++) {
+		uint32_t c = src32[i];
+		dst32[i] = 0xFF000000 | (c & 0xFF00) | ((c >> 16) & 0xFF) | ((c & 0xFF) << 16);
+	}
+}
 
-		dbg("found plane %d", *plane_id);
+/* 8 bit channels to 10 bits: replicate the top bits so that white stays white */
+static void px_xrgb8888_to_xrgb2101010(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	const uint32_t *src32 = (const uint32_t *)src;
+	uint32_t *dst32 = (uint32_t *)dst;
+	uint32_t i = 0;
+
+#if DRM_NEON
+	for (; i + 4 <= px_cnt; i += 4) {
+		uint32x4_t c = vld1q_u32(src32 + i);
+		uint32x4_t ff = vdupq_n_u32(0xFF);
+		uint32x4_t r = vandq_u32(vshrq_n_u32(c, 16), ff);
+		uint32x4_t g = vandq_u32(vshrq_n_u32(c, 8), ff);
+		uint32x4_t b = vandq_u32(c, ff);
+		r = vorrq_u32(vshlq_n_u32(r, 2), vshrq_n_u32(r, 6));
+		g = vorrq_u32(vshlq_n_u32(g, 2), vshrq_n_u32(g, 6));
+		b = vorrq_u32(vshlq_n_u32(b, 2), vshrq_n_u32(b, 6));
+		vst1q_u32(dst32 + i, vorrq_u32(vorrq_u32(vshlq_n_u32(r, 20), vshlq_n_u32(g, 10)),
+					       vorrq_u32(b, vdupq_n_u32(0xC0000000))));
+	}
+#elif DRM_SSE2
+	for (; i + 4 <= px_cnt; i += 4) {
+		__m128i c = _mm_loadu_si128((const __m128i *)(src32 + i));
+		__m128i ff = _mm_set1_epi32(0xFF);
+		__m128i r = _mm_and_si128(_mm_srli_epi32(c, 16), ff);
+		__m128i g = _mm_and_si128(_mm_srli_epi32(c, 8), ff);
+		__m128i b = _mm_and_si128(c, ff);
+		r = _mm_or_si128(_mm_slli_epi32(r, 2), _mm_srli_epi32(r, 6));
+		g = _mm_or_si128(_mm_slli_epi32(g, 2), _mm_srli_epi32(g, 6));
+		b = _mm_or_si128(_mm_slli_epi32(b, 2), _mm_srli_epi32(b, 6));
+		_mm_storeu_si128((__m128i *)(dst32 + i),
+				 _mm_or_si128(_mm_or_si128(_mm_slli_epi32(r, 20), _mm_slli_epi32(g, 10)),
+					      _mm_or_si128(b, _mm_set1_epi32((int)0xC0000000))));
+	}
+#endif
 
-		break;
+	for (; i < px_cnt; i++) {
+		uint32_t c = src32[i];
+		uint32_t r = (c >> 16) & 0xFF, g = (c >> 8) & 0xFF, b = c & 0xFF;
+		dst32[i] = 0xC0000000 | ((r << 2 | r >> 6) << 20) | ((g << 2 | g >> 6) << 10) | (b << 2 | b >> 6);
 	}
+}
 
-	if (i == planes->count_planes)
-		ret = -1;
+/* RGB888 is stored B, G, R, BGR888 R, G, B */
+static inline void px_xrgb8888_to_888(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt, bool bgr)
+{
+	const uint8_t *src8 = (const uint8_t *)src;
+	uint32_t i = 0;
+
+#if DRM_NEON
+	for (; i + 16 <= px_cnt; i += 16) {
+		uint8x16x4_t px = vld4q_u8(src8 + i * 4);
+		uint8x16x3_t out = {{px.val[bgr ? 2 : 0], px.val[1], px.val[bgr ? 0 : 2]}};
+		vst3q_u8(dst + i * 3, out);
+	}
+#endif
 
-	drmModeFreePlaneResources(planes);
+	for (; i < px_cnt; i++) {
+		dst[i * 3] = src8[i * 4 + (bgr ? 2 : 0)];
+		dst[i * 3 + 1] = src8[i * 4 + 1];
+		dst[i * 3 + 2] = src8[i * 4 + (bgr ? 0 : 2)];
+	}
+}
 
-	return ret;
+static void px_xrgb8888_to_rgb888(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	px_xrgb8888_to_888(dst, src, px_cnt, false);
 }
 
-static int drm_find_connector(void)
+static void px_xrgb8888_to_bgr888(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
 {
-	drmModeConnector *conn = NULL;
-	drmModeEncoder *enc = NULL;
-	drmModeRes *res;
-	int i;
+	px_xrgb8888_to_888(dst, src, px_cnt, true);
+}
 
-	if ((res = drmModeGetResources(drm_dev.fd)) == NULL) {
-		err("drmModeGetResources() failed");
-		return -1;
+#if DRM_SSSE3_DISPATCH
+__attribute__((target("ssse3")))
+static inline void px_xrgb8888_to_888_ssse3(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt, bool bgr)
+{
+	const uint8_t *src8 = (const uint8_t *)src;
+	const __m128i pack = bgr ? _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1)
+				 : _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	uint32_t i = 0;
+
+	/* Pack 16 pixels into 3 full 16 byte stores */
+	for (; i + 16 <= px_cnt; i += 16) {
+		__m128i p0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src8 + i * 4)), pack);
+		__m128i p1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src8 + i * 4 + 16)), pack);
+		__m128i p2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src8 + i * 4 + 32)), pack);
+		__m128i p3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src8 + i * 4 + 48)), pack);
+		_mm_storeu_si128((__m128i *)(dst + i * 3), _mm_or_si128(p0, _mm_slli_si128(p1, 12)));
+		_mm_storeu_si128((__m128i *)(dst + i * 3 + 16), _mm_or_si128(_mm_srli_si128(p1, 4), _mm_slli_si128(p2, 8)));
+		_mm_storeu_si128((__m128i *)(dst + i * 3 + 32), _mm_or_si128(_mm_srli_si128(p2, 8), _mm_slli_si128(p3, 4)));
 	}
 
-	if (res->count_crtcs <= 0) {
-		err("no Crtcs");
-		goto free_res;
-	}
+	if (i < px_cnt)
+		px_xrgb8888_to_888(dst + i * 3, src + i, px_cnt - i, bgr);
+}
 
-	/* find all available connectors */
-	for (i = 0; i < res->count_connectors; i++) {
-		conn = drmModeGetConnector(drm_dev.fd, res->connectors[i]);
-		if (!conn)
-			continue;
+__attribute__((target("ssse3")))
+static void px_xrgb8888_to_rgb888_ssse3(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	px_xrgb8888_to_888_ssse3(dst, src, px_cnt, false);
+}
 
-#if DRM_CONNECTOR_ID >= 0
-		if (conn->connector_id != DRM_CONNECTOR_ID) {
-			drmModeFreeConnector(conn);
-			continue;
+__attribute__((target("ssse3")))
+static void px_xrgb8888_to_bgr888_ssse3(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	px_xrgb8888_to_888_ssse3(dst, src, px_cnt, true);
+}
+#endif
+
+static inline void px_xrgb8888_to_565(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt, bool bgr)
+{
+	const uint32_t *src32 = (const uint32_t *)src;
+	uint16_t *dst16 = (uint16_t *)dst;
+	uint32_t i = 0;
+
+#if DRM_NEON
+	for (; i + 16 <= px_cnt; i += 16) {
+		uint8x16x4_t px = vld4q_u8((const uint8_t *)(src32 + i));
+		uint8x16_t first = px.val[bgr ? 0 : 2], last = px.val[bgr ? 2 : 0];
+		uint16x8_t lo = vshll_n_u8(vget_low_u8(first), 8);
+		uint16x8_t hi = vshll_n_u8(vget_high_u8(first), 8);
+		lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(px.val[1]), 8), 5);
+		hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(px.val[1]), 8), 5);
+		lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(last), 8), 11);
+		hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(last), 8), 11);
+		vst1q_u16(dst16 + i, lo);
+		vst1q_u16(dst16 + i + 8, hi);
+	}
+#elif DRM_SSE2
+	for (; i + 8 <= px_cnt; i += 8) {
+		__m128i a = px_sse2_xrgb8888_to_565(_mm_loadu_si128((const __m128i *)(src32 + i)), bgr);
+		__m128i b = px_sse2_xrgb8888_to_565(_mm_loadu_si128((const __m128i *)(src32 + i + 4)), bgr);
+		_mm_storeu_si128((__m128i *)(dst16 + i), _mm_packs_epi32(a, b));
+	}
+#endif
+
+	for (; i < px_cnt; i++) {
+		uint32_t c = src32[i];
+		if (bgr)
+			dst16[i] = ((c << 8) & 0xF800) | ((c >> 5) & 0x07E0) | ((c >> 19) & 0x001F);
+		else
+			dst16[i] = ((c >> 8) & 0xF800) | ((c >> 5) & 0x07E0) | ((c >> 3) & 0x001F);
+	}
+}
+
+static void px_xrgb8888_to_rgb565(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	px_xrgb8888_to_565(dst, src, px_cnt, false);
+}
+
+static void px_xrgb8888_to_bgr565(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	px_xrgb8888_to_565(dst, src, px_cnt, true);
+}
+
+#elif LV_COLOR_DEPTH == 16
+
+#if DRM_SSE2
+/* 4 RGB565 pixels in 32 bit lanes to XRGB8888 */
+static inline __m128i px_sse2_rgb565_to_xrgb8888(__m128i c)
+{
+	__m128i r = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(c, _mm_set1_epi32(0xF800)), 8),
+				 _mm_slli_epi32(_mm_and_si128(c, _mm_set1_epi32(0xE000)), 3));
+	__m128i g = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(c, _mm_set1_epi32(0x07E0)), 5),
+				 _mm_srli_epi32(_mm_and_si128(c, _mm_set1_epi32(0x0600)), 1));
+	__m128i b = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(c, _mm_set1_epi32(0x001F)), 3),
+				 _mm_srli_epi32(_mm_and_si128(c, _mm_set1_epi32(0x001C)), 2));
+	return _mm_or_si128(_mm_or_si128(r, g), _mm_or_si128(b, _mm_set1_epi32((int)0xFF000000)));
+}
+#endif
+
+/* Expand to 8 bits, replicating the top bits so that white stays white */
+#define PX_565_R8(c) ((((c) >> 8) & 0xF8) | ((c) >> 13))
+#define PX_565_G8(c) ((((c) >> 3) & 0xFC) | (((c) >> 9) & 0x03))
+#define PX_565_B8(c) ((((c) << 3) & 0xF8) | (((c) >> 2) & 0x07))
+
+static inline void px_rgb565_to_8888(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt, bool bgr)
+{
+	const uint16_t *src16 = (const uint16_t *)src;
+	uint32_t *dst32 = (uint32_t *)dst;
+	uint32_t i = 0;
+
+#if DRM_NEON
+	for (; i + 8 <= px_cnt; i += 8) {
+		uint16x8_t c = vld1q_u16(src16 + i);
+		uint8x8_t r = vshrn_n_u16(c, 8);
+		uint8x8_t g = vshrn_n_u16(c, 3);
+		uint8x8_t b = vmovn_u16(vshlq_n_u16(c, 3));
+		uint8x8x4_t out;
+		r = vsri_n_u8(r, r, 5);
+		g = vsri_n_u8(g, g, 6);
+		b = vsri_n_u8(b, b, 5);
+		out.val[0] = bgr ? r : b;
+		out.val[1] = g;
+		out.val[2] = bgr ? b : r;
+		out.val[3] = vdup_n_u8(0xFF);
+		vst4_u8((uint8_t *)(dst32 + i), out);
+	}
+#elif DRM_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 8 <= px_cnt; i += 8) {
+		__m128i c = _mm_loadu_si128((const __m128i *)(src16 + i));
+		__m128i lo = px_sse2_rgb565_to_xrgb8888(_mm_unpacklo_epi16(c, zero));
+		__m128i hi = px_sse2_rgb565_to_xrgb8888(_mm_unpackhi_epi16(c, zero));
+		if (bgr) {
+			lo = px_sse2_swap_rb(lo);
+			hi = px_sse2_swap_rb(hi);
 		}
+		_mm_storeu_si128((__m128i *)(dst32 + i), lo);
+		_mm_storeu_si128((__m128i *)(dst32 + i + 4), hi);
+	}
 #endif
 
-		if (conn->connection == DRM_MODE_CONNECTED) {
-			dbg("drm: connector %d: connected", conn->connector_id);
-		} else if (conn->connection == DRM_MODE_DISCONNECTED) {
-			dbg("drm: connector %d: disconnected", conn->connector_id);
-		} else if (conn->connection == DRM_MODE_UNKNOWNCONNECTION) {
-			dbg("drm: connector %d: unknownconnection", conn->connector_id);
-		} else {
-			dbg("drm: connector %d: unknown", conn->connector_id);
+	for (; i < px_cnt; i++) {
+		uint32_t c = src16[i];
+		uint32_t r = PX_565_R8(c), g = PX_565_G8(c), b = PX_565_B8(c);
+		dst32[i] = 0xFF000000 | (bgr ? b : r) << 16 | g << 8 | (bgr ? r : b);
+	}
+}
+
+static void px_rgb565_to_xrgb8888(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	px_rgb565_to_8888(dst, src, px_cnt, false);
+}
+
+static void px_rgb565_to_xbgr8888(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	px_rgb565_to_8888(dst, src, px_cnt, true);
+}
+
+static void px_rgb565_to_bgr565(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	const uint16_t *src16 = (const uint16_t *)src;
+	uint16_t *dst16 = (uint16_t *)dst;
+	uint32_t i = 0;
+
+#if DRM_NEON
+	for (; i + 8 <= px_cnt; i += 8) {
+		uint16x8_t c = vld1q_u16(src16 + i);
+		c = vorrq_u16(vorrq_u16(vshrq_n_u16(c, 11), vandq_u16(c, vdupq_n_u16(0x07E0))), vshlq_n_u16(c, 11));
+		vst1q_u16(dst16 + i, c);
+	}
+#elif DRM_SSE2
+	for (; i + 8 <= px_cnt; i += 8) {
+		__m128i c = _mm_loadu_si128((const __m128i *)(src16 + i));
+		c = _mm_or_si128(_mm_or_si128(_mm_srli_epi16(c, 11), _mm_and_si128(c, _mm_set1_epi16(0x07E0))),
+				 _mm_slli_epi16(c, 11));
+		_mm_storeu_si128((__m128i *)(dst16 + i), c);
+	}
+#endif
+
+	for (; i < px_cnt; i++) {
+		uint16_t c = src16[i];
+		dst16[i] = (c >> 11) | (c & 0x07E0) | (uint16_t)(c << 11);
+	}
+}
+
+/* RGB888 is stored B, G, R, BGR888 R, G, B */
+static inline void px_rgb565_to_888(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt, bool bgr)
+{
+	const uint16_t *src16 = (const uint16_t *)src;
+	uint32_t i;
+
+	for (i = 0; i < px_cnt; i++) {
+		uint32_t c = src16[i];
+		dst[i * 3] = bgr ? PX_565_R8(c) : PX_565_B8(c);
+		dst[i * 3 + 1] = PX_565_G8(c);
+		dst[i * 3 + 2] = bgr ? PX_565_B8(c) : PX_565_R8(c);
+	}
+}
+
+static void px_rgb565_to_rgb888(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	px_rgb565_to_888(dst, src, px_cnt, false);
+}
+
+static void px_rgb565_to_bgr888(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	px_rgb565_to_888(dst, src, px_cnt, true);
+}
+
+static void px_rgb565_to_xrgb2101010(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	const uint16_t *src16 = (const uint16_t *)src;
+	uint32_t *dst32 = (uint32_t *)dst;
+	uint32_t i;
+
+	for (i = 0; i < px_cnt; i++) {
+		uint32_t c = src16[i];
+		uint32_t r = c >> 11, g = (c >> 5) & 0x3F, b = c & 0x1F;
+		dst32[i] = 0xC0000000 | ((r << 5 | r) << 20) | ((g << 4 | g >> 2) << 10) | (b << 5 | b);
+	}
+}
+
+#endif /* LV_COLOR_DEPTH */
+
+/* Buffer formats in order of preference: LVGL's own first, then by quality */
+static const struct {
+	uint32_t fourcc;
+	uint32_t bpp;
+} drm_formats[] = {
+#if LV_COLOR_DEPTH == 32
+	{ DRM_FORMAT_XRGB8888, 32 },
+	{ DRM_FORMAT_ARGB8888, 32 },
+	{ DRM_FORMAT_XBGR8888, 32 },
+	{ DRM_FORMAT_ABGR8888, 32 },
+	{ DRM_FORMAT_XRGB2101010, 32 },
+	{ DRM_FORMAT_RGB888, 24 },
+	{ DRM_FORMAT_BGR888, 24 },
+	{ DRM_FORMAT_RGB565, 16 },
+	{ DRM_FORMAT_BGR565, 16 },
+#elif LV_COLOR_DEPTH == 16
+	{ DRM_FORMAT_RGB565, 16 },
+	{ DRM_FORMAT_BGR565, 16 },
+	{ DRM_FORMAT_RGB888, 24 },
+	{ DRM_FORMAT_BGR888, 24 },
+	{ DRM_FORMAT_XRGB8888, 32 },
+	{ DRM_FORMAT_ARGB8888, 32 },
+	{ DRM_FORMAT_XBGR8888, 32 },
+	{ DRM_FORMAT_ABGR8888, 32 },
+	{ DRM_FORMAT_XRGB2101010, 32 },
+#else
+#error LV_COLOR_DEPTH not supported
+#endif
+};
+
+/*
+ * Conversion from LVGL's pixels into a buffer format, NULL if it is LVGL's.
+ */
+static drm_px_conv_t drm_select_px_conv(uint32_t fourcc)
+{
+	switch (fourcc) {
+#if LV_COLOR_DEPTH == 32
+	case DRM_FORMAT_ARGB8888:
+		return px_xrgb8888_to_argb8888;
+	case DRM_FORMAT_XBGR8888:
+	case DRM_FORMAT_ABGR8888:
+		return px_xrgb8888_to_xbgr8888;
+	case DRM_FORMAT_XRGB2101010:
+		return px_xrgb8888_to_xrgb2101010;
+	case DRM_FORMAT_RGB888:
+#if DRM_SSSE3_DISPATCH
+		if (__builtin_cpu_supports("ssse3"))
+			return px_xrgb8888_to_rgb888_ssse3;
+#endif
+		return px_xrgb8888_to_rgb888;
+	case DRM_FORMAT_BGR888:
+#if DRM_SSSE3_DISPATCH
+		if (__builtin_cpu_supports("ssse3"))
+			return px_xrgb8888_to_bgr888_ssse3;
+#endif
+		return px_xrgb8888_to_bgr888;
+	case DRM_FORMAT_RGB565:
+		return px_xrgb8888_to_rgb565;
+	case DRM_FORMAT_BGR565:
+		return px_xrgb8888_to_bgr565;
+#elif LV_COLOR_DEPTH == 16
+	case DRM_FORMAT_XRGB8888:
+	case DRM_FORMAT_ARGB8888:
+		return px_rgb565_to_xrgb8888;
+	case DRM_FORMAT_XBGR8888:
+	case DRM_FORMAT_ABGR8888:
+		return px_rgb565_to_xbgr8888;
+	case DRM_FORMAT_XRGB2101010:
+		return px_rgb565_to_xrgb2101010;
+	case DRM_FORMAT_RGB888:
+		return px_rgb565_to_rgb888;
+	case DRM_FORMAT_BGR888:
+		return px_rgb565_to_bgr888;
+	case DRM_FORMAT_BGR565:
+		return px_rgb565_to_bgr565;
+#endif
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * Read the type (primary, overlay or cursor) of a plane, -1 if unknown.
+ */
+static int drm_plane_type(uint32_t plane_id)
+{
+	drmModeObjectPropertiesPtr props;
+	uint32_t i;
+	int type = -1;
+
+	props = drmModeObjectGetProperties(drm_dev.fd, plane_id, DRM_MODE_OBJECT_PLANE);
+	if (!props)
+		return -1;
+
+	for (i = 0; i < props->count_props && type < 0; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(drm_dev.fd, props->props[i]);
+		if (!prop)
+			continue;
+		if (!strcmp(prop->name, "type"))
+			type = props->prop_values[i];
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+
+	return type;
+}
+
+/*
+ * CRTCs and planes already driven by another output can't be shared.
+ */
+static bool drm_crtc_in_use(uint32_t crtc_id)
+{
+	uint32_t i;
+
+	for (i = 0; i < drm_dev.output_cnt; i++) {
+		if (drm_dev.outputs[i].crtc_id == crtc_id)
+			return true;
+	}
+
+	return false;
+}
+
+static bool drm_plane_in_use(uint32_t plane_id)
+{
+	uint32_t i;
+
+	for (i = 0; i < drm_dev.output_cnt; i++) {
+		if (drm_dev.outputs[i].plane_id == plane_id ||
+		    drm_dev.outputs[i].cursor.plane_id == plane_id)
+			return true;
+#if DRM_MAX_LAYERS > 0
+		for (int j = 0; j < DRM_MAX_LAYERS; j++) {
+			if (drm_dev.outputs[i].layers[j].plane_id == plane_id)
+				return true;
 		}
+#endif
+	}
 
-		if (conn->connection == DRM_MODE_CONNECTED && conn->count_modes > 0)
-			break;
+	return false;
+}
 
-		drmModeFreeConnector(conn);
-		conn = NULL;
-	};
+/*
+ * Find a free plane of the CRTC taking the format. Cursor planes are only
+ * used for the cursor, layers need overlay planes and the output's own
+ * display takes a primary or an overlay plane.
+ */
+static int find_plane(unsigned int fourcc, uint32_t *plane_id, uint32_t crtc_idx, int type)
+{
+	drmModePlaneResPtr planes;
+	drmModePlanePtr plane;
+	unsigned int i;
+	unsigned int j;
+	int ret = 0;
+	int plane_type;
+	unsigned int format = fourcc;
 
-	if (!conn) {
-		err("suitable connector not found");
-		goto free_res;
+	planes = drmModeGetPlaneResources(drm_dev.fd);
+	if (!planes) {
+		err("drmModeGetPlaneResources failed");
+		return -1;
 	}
 
-	drm_dev.conn_id = conn->connector_id;
-	dbg("conn_id: %d", drm_dev.conn_id);
-	drm_dev.mmWidth = conn->mmWidth;
-	drm_dev.mmHeight = conn->mmHeight;
+	dbg("drm: found planes %u", planes->count_planes);
+
+	for (i = 0; i < planes->count_planes; ++i) {
+		plane = drmModeGetPlane(drm_dev.fd, planes->planes[i]);
+		if (!plane) {
+			err("drmModeGetPlane failed: %s", strerror(errno));
+			break;
+		}
+
+		if (!(plane->possible_crtcs & (1 << crtc_idx)) || drm_plane_in_use(plane->plane_id)) {
+			drmModeFreePlane(plane);
+			continue;
+		}
+
+		/* Cursor planes are usually small, use them only for the cursor */
+		plane_type = drm_plane_type(plane->plane_id);
+		if ((type == DRM_PLANE_TYPE_CURSOR) != (plane_type == DRM_PLANE_TYPE_CURSOR) ||
+		    (type == DRM_PLANE_TYPE_OVERLAY && plane_type != DRM_PLANE_TYPE_OVERLAY)) {
+			drmModeFreePlane(plane);
+			continue;
+		}
 
-	lv_memcpy(&drm_dev.mode, &conn->modes[0], sizeof(drmModeModeInfo));
+		for (j = 0; j < plane->count_formats; ++j) {
+			if (plane->formats[j] == format)
+				break;
+		}
 
-	if (drmModeCreatePropertyBlob(drm_dev.fd, &drm_dev.mode, sizeof(drm_dev.mode),
-				      &drm_dev.blob_id)) {
-		err("error creating mode blob");
-		goto free_res;
+		if (j == plane->count_formats) {
+			drmModeFreePlane(plane);
+			continue;
+		}
+
+		*plane_id = plane->plane_id;
+		drmModeFreePlane(plane);
+
+		dbg("found plane %d", *plane_id);
+
+		break;
 	}
 
-	drm_dev.width = conn->modes[0].hdisplay;
-	drm_dev.height = conn->modes[0].vdisplay;
+	if (i == planes->count_planes)
+		ret = -1;
+
+	drmModeFreePlaneResources(planes);
+
+	return ret;
+}
+
+/*
+ * Pick a CRTC for the connector: the one its encoder already drives, otherwise
+ * the first one a possible encoder supports and no other output uses.
+ */
+static int drm_find_crtc(struct drm_output *out, drmModeRes *res, drmModeConnector *conn)
+{
+	drmModeEncoder *enc;
+	int i, crtc;
+
+	if (conn->encoder_id) {
+		enc = drmModeGetEncoder(drm_dev.fd, conn->encoder_id);
+		if (enc) {
+			if (enc->crtc_id && !drm_crtc_in_use(enc->crtc_id)) {
+				out->enc_id = enc->encoder_id;
+				out->crtc_id = enc->crtc_id;
+			}
+			drmModeFreeEncoder(enc);
+		}
+	}
 
-	for (i = 0 ; i < res->count_encoders; i++) {
-		enc = drmModeGetEncoder(drm_dev.fd, res->encoders[i]);
+	/* Encoder hasn't been associated yet (or its CRTC is taken), look it up */
+	for (i = 0; !out->crtc_id && i < conn->count_encoders; i++) {
+		enc = drmModeGetEncoder(drm_dev.fd, conn->encoders[i]);
 		if (!enc)
 			continue;
 
-		dbg("enc%d enc_id %d conn enc_id %d", i, enc->encoder_id, conn->encoder_id);
+		for (crtc = 0 ; crtc < res->count_crtcs; crtc++) {
+			dbg("enc_id %d crtc%d id %d possible %x", enc->encoder_id, crtc, res->crtcs[crtc], enc->possible_crtcs);
 
-		if (enc->encoder_id == conn->encoder_id)
-			break;
+			if ((enc->possible_crtcs & (1 << crtc)) && !drm_crtc_in_use(res->crtcs[crtc])) {
+				out->enc_id = enc->encoder_id;
+				out->crtc_id = res->crtcs[crtc];
+				break;
+			}
+		}
 
 		drmModeFreeEncoder(enc);
-		enc = NULL;
 	}
 
-	if (enc) {
-		drm_dev.enc_id = enc->encoder_id;
-		dbg("enc_id: %d", drm_dev.enc_id);
-		drm_dev.crtc_id = enc->crtc_id;
-		dbg("crtc_id: %d", drm_dev.crtc_id);
-		drmModeFreeEncoder(enc);
-	} else {
-		/* Encoder hasn't been associated yet, look it up */
-		for (i = 0; i < conn->count_encoders; i++) {
-			int crtc, crtc_id = -1;
+	if (!out->crtc_id) {
+		err("suitable encoder not found for connector %u", out->conn_id);
+		return -1;
+	}
 
-			enc = drmModeGetEncoder(drm_dev.fd, conn->encoders[i]);
-			if (!enc)
-				continue;
+	dbg("enc_id: %d crtc_id: %d", out->enc_id, out->crtc_id);
+
+	out->crtc_idx = UINT32_MAX;
+
+	for (i = 0; i < res->count_crtcs; ++i) {
+		if (out->crtc_id == res->crtcs[i]) {
+			out->crtc_idx = i;
+			break;
+		}
+	}
+
+	if (out->crtc_idx == UINT32_MAX) {
+		err("drm: CRTC not found");
+		return -1;
+	}
+
+	dbg("crtc_idx: %d", out->crtc_idx);
+
+	return 0;
+}
+
+static void drm_free_dumb(struct drm_buffer *buf)
+{
+	struct drm_mode_destroy_dumb dreq;
+
+	if (buf->fb_handle)
+		drmModeRmFB(drm_dev.fd, buf->fb_handle);
+	if (buf->map && buf->map != MAP_FAILED)
+		munmap(buf->map, buf->size);
+	if (buf->handle) {
+		lv_memset(&dreq, 0, sizeof(dreq));
+		dreq.handle = buf->handle;
+		drmIoctl(drm_dev.fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+	}
+
+	lv_memset(buf, 0, sizeof(*buf));
+}
+
+/*
+ * Free the buffers following from the mode.
+ */
+static void drm_output_free_buffers(struct drm_output *out)
+{
+	int i;
+
+	for (i = 0; i < DRM_BUFFER_COUNT; i++)
+		drm_free_dumb(&out->drm_bufs[i]);
+	lv_free(out->shadow);
+	lv_free(out->map_col);
+	lv_free(out->map_row);
+	lv_free(out->map_line);
+	lv_free(out->conv_line);
+	out->shadow = NULL;
+	out->map_col = NULL;
+	out->map_row = NULL;
+	out->map_line = NULL;
+	out->conv_line = NULL;
+	out->sw_transform = false;
+}
+
+static void drm_output_free(struct drm_output *out)
+{
+	int i;
+
+	drm_output_free_buffers(out);
+	drm_free_dumb(&out->cursor.buf);
+#if DRM_MAX_LAYERS > 0
+	for (i = 0; i < DRM_MAX_LAYERS; i++)
+		drm_layer_free(&out->layers[i]);
+#endif
+#if DRM_CAPTURE
+	drm_capture_free(out);
+#endif
+
+	if (out->req)
+		drmModeAtomicFree(out->req);
+	if (out->blob_id)
+		drmModeDestroyPropertyBlob(drm_dev.fd, out->blob_id);
+	if (out->plane)
+		drmModeFreePlane(out->plane);
+	if (out->crtc)
+		drmModeFreeCrtc(out->crtc);
+	if (out->conn)
+		drmModeFreeConnector(out->conn);
+
+	lv_memset(out, 0, sizeof(*out));
+}
+
+/*
+ * Take the mode and the sizes following from it, the buffers are set up later.
+ */
+static void drm_output_use_mode(struct drm_output *out, const drmModeModeInfo *mode)
+{
+	lv_memcpy(&out->mode, mode, sizeof(drmModeModeInfo));
+#if DRM_ROTATION == 90 || DRM_ROTATION == 270
+	out->rotation = DRM_ROTATION == 90 ? LV_DISP_ROT_90 : LV_DISP_ROT_270;
+	out->width = mode->vdisplay * DRM_RENDER_SCALE / 100;
+	out->height = mode->hdisplay * DRM_RENDER_SCALE / 100;
+#else
+	out->rotation = DRM_ROTATION == 180 ? LV_DISP_ROT_180 : LV_DISP_ROT_NONE;
+	out->width = mode->hdisplay * DRM_RENDER_SCALE / 100;
+	out->height = mode->vdisplay * DRM_RENDER_SCALE / 100;
+#endif
+	out->plane_rotation = DRM_MODE_ROTATE_0;
+	out->period_ns = out->mode.clock ? (uint64_t)out->mode.htotal * out->mode.vtotal * 1000000 / out->mode.clock
+					 : 1000000000 / 60;
+	out->fb_width = out->width;
+	out->fb_height = out->height;
+}
+
+/*
+ * Set up an output for a connected connector, it takes over the connector.
+ */
+static int drm_output_setup(struct drm_output *out, drmModeRes *res, drmModeConnector *conn)
+{
+	uint32_t i;
+	int ret;
+
+	lv_memset(out, 0, sizeof(*out));
+	out->conn = conn;
+	out->conn_id = conn->connector_id;
+	dbg("conn_id: %d", out->conn_id);
+	out->mmWidth = conn->mmWidth;
+	out->mmHeight = conn->mmHeight;
+
+	drm_output_use_mode(out, &conn->modes[0]);
+
+	ret = drm_find_crtc(out, res, conn);
+	if (ret)
+		goto err;
+
+	/* The first format in order of preference some plane of the CRTC takes */
+	ret = -1;
+	for (i = 0; i < sizeof(drm_formats) / sizeof(drm_formats[0]) && ret; i++) {
+		ret = find_plane(drm_formats[i].fourcc, &out->plane_id, out->crtc_idx, DRM_PLANE_TYPE_PRIMARY);
+		if (ret == 0) {
+			out->fourcc = drm_formats[i].fourcc;
+			out->bpp = drm_formats[i].bpp;
+			out->px_conv = drm_select_px_conv(out->fourcc);
+		}
+	}
+	if (ret) {
+		err("Cannot find plane");
+		goto err;
+	}
+
+	ret = drmModeCreatePropertyBlob(drm_dev.fd, &out->mode, sizeof(out->mode), &out->blob_id);
+	if (ret) {
+		err("error creating mode blob");
+		goto err;
+	}
+
+	out->plane = drmModeGetPlane(drm_dev.fd, out->plane_id);
+	if (!out->plane) {
+		err("Cannot get plane");
+		goto err;
+	}
+
+	out->crtc = drmModeGetCrtc(drm_dev.fd, out->crtc_id);
+	if (!out->crtc) {
+		err("Cannot get crtc");
+		goto err;
+	}
+
+	ret = drm_object_init(&out->plane_obj, out->plane_id, DRM_MODE_OBJECT_PLANE);
+	if (ret) {
+		err("Cannot get plane props");
+		goto err;
+	}
+
+	ret = drm_object_init(&out->crtc_obj, out->crtc_id, DRM_MODE_OBJECT_CRTC);
+	if (ret) {
+		err("Cannot get crtc props");
+		goto err;
+	}
+
+	ret = drm_object_init(&out->conn_obj, out->conn_id, DRM_MODE_OBJECT_CONNECTOR);
+	if (ret) {
+		err("Cannot get connector props");
+		goto err;
+	}
+
+	out->req = drmModeAtomicAlloc();
+	if (!out->req) {
+		err("Cannot allocate atomic request");
+		goto err;
+	}
+
+	info("drm: Found plane_id: %u connector_id: %d crtc_id: %d",
+		out->plane_id, out->conn_id, out->crtc_id);
+
+	info("drm: %dx%d (%dmm X% dmm) pixel format %c%c%c%c%s",
+	     out->mode.hdisplay, out->mode.vdisplay, out->mmWidth, out->mmHeight,
+	     (out->fourcc>>0)&0xff, (out->fourcc>>8)&0xff, (out->fourcc>>16)&0xff, (out->fourcc>>24)&0xff,
+	     out->px_conv ? " (converted)" : "");
+
+	return 0;
+
+err:
+	drm_output_free(out);
+	return -1;
+}
+
+/*
+ * Set up an output for every connected connector (or just DRM_CONNECTOR_ID),
+ * at most max of them.
+ */
+static int drm_find_outputs(uint32_t max)
+{
+	drmModeConnector *conn;
+	drmModeRes *res;
+	int i;
+
+	if ((res = drmModeGetResources(drm_dev.fd)) == NULL) {
+		err("drmModeGetResources() failed");
+		return -1;
+	}
+
+	if (res->count_crtcs <= 0) {
+		err("no Crtcs");
+		goto free_res;
+	}
+
+	/* find all available connectors */
+	for (i = 0; i < res->count_connectors && drm_dev.output_cnt < max; i++) {
+		conn = drmModeGetConnector(drm_dev.fd, res->connectors[i]);
+		if (!conn)
+			continue;
+
+#if DRM_CONNECTOR_ID >= 0
+		if (conn->connector_id != DRM_CONNECTOR_ID) {
+			drmModeFreeConnector(conn);
+			continue;
+		}
+#endif
+
+		if (conn->connection == DRM_MODE_CONNECTED) {
+			dbg("drm: connector %d: connected", conn->connector_id);
+		} else if (conn->connection == DRM_MODE_DISCONNECTED) {
+			dbg("drm: connector %d: disconnected", conn->connector_id);
+		} else if (conn->connection == DRM_MODE_UNKNOWNCONNECTION) {
+			dbg("drm: connector %d: unknownconnection", conn->connector_id);
+		} else {
+			dbg("drm: connector %d: unknown", conn->connector_id);
+		}
+
+		if (conn->connection != DRM_MODE_CONNECTED || conn->count_modes <= 0) {
+			drmModeFreeConnector(conn);
+			continue;
+		}
+
+		/* The output frees the connector if it can't be used */
+		if (drm_output_setup(&drm_dev.outputs[drm_dev.output_cnt], res, conn) == 0)
+			drm_dev.output_cnt++;
+	}
+
+	if (!drm_dev.output_cnt) {
+		err("suitable connector not found");
+		goto free_res;
+	}
+
+	drmModeFreeResources(res);
+
+	return 0;
+
+free_res:
+	drmModeFreeResources(res);
+
+	return -1;
+}
+
+static int drm_open(const char *path)
+{
+	int fd, flags;
+	uint64_t has_dumb;
+	int ret;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		err("cannot open \"%s\"", path);
+		return -1;
+	}
+
+	/* set FD_CLOEXEC flag */
+	if ((flags = fcntl(fd, F_GETFD)) < 0 ||
+	     fcntl(fd, F_SETFD, flags | FD_CLOEXEC) < 0) {
+		err("fcntl FD_CLOEXEC failed");
+		goto err;
+	}
+
+	/* check capability */
+	ret = drmGetCap(fd, DRM_CAP_DUMB_BUFFER, &has_dumb);
+	if (ret < 0 || has_dumb == 0) {
+		err("drmGetCap DRM_CAP_DUMB_BUFFER failed or \"%s\" doesn't have dumb "
+		    "buffer", path);
+		goto err;
+	}
+
+	return fd;
+err:
+	close(fd);
+	return -1;
+}
+
+static int drm_setup(uint32_t max_outputs)
+{
+	uint64_t cap = 0;
+	int ret;
+	const char *device_path = NULL;
+#if DRM_HOTPLUG
+	struct stat st;
+#endif
+
+	device_path = getenv("DRM_CARD");
+	if (!device_path)
+		device_path = DRM_CARD;
+
+	drm_dev.output_cnt = 0;
+	drm_dev.fd = drm_open(device_path);
+	if (drm_dev.fd < 0)
+		return -1;
+
+	ret = drmSetClientCap(drm_dev.fd, DRM_CLIENT_CAP_ATOMIC, 1);
+	if (ret) {
+		err("No atomic modesetting support: %s", strerror(errno));
+		goto err;
+	}
+
+#if DRM_HOTPLUG
+	drm_dev.minor = fstat(drm_dev.fd, &st) == 0 ? minor(st.st_rdev) : UINT32_MAX;
+#endif
+
+	/* Flip times can be compared with CLOCK_MONOTONIC only with this */
+	drm_dev.monotonic = drmGetCap(drm_dev.fd, DRM_CAP_TIMESTAMP_MONOTONIC, &cap) == 0 && cap;
+	if (!drm_dev.monotonic)
+		info("drm: flip timestamps aren't monotonic, no vblank prediction");
+
+	ret = drm_find_outputs(max_outputs);
+	if (ret) {
+		err("available drm devices not found");
+		goto err;
+	}
+
+	/* One event loop for the flips of all outputs */
+	drm_dev.drm_event_ctx.version = DRM_EVENT_CONTEXT_VERSION;
+	drm_dev.drm_event_ctx.page_flip_handler = page_flip_handler;
+
+	return 0;
+
+err:
+	close(drm_dev.fd);
+	return -1;
+}
+
+static int drm_allocate_dumb(struct drm_buffer *buf, uint32_t width, uint32_t height, uint32_t bpp,
+			     uint32_t fourcc)
+{
+	struct drm_mode_create_dumb creq;
+	struct drm_mode_map_dumb mreq;
+	uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
+	int ret;
+
+	/* create dumb buffer */
+	lv_memset(&creq, 0, sizeof(creq));
+	creq.width = width;
+	creq.height = height;
+	creq.bpp = bpp;
+	ret = drmIoctl(drm_dev.fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq);
+	if (ret < 0) {
+		err("DRM_IOCTL_MODE_CREATE_DUMB fail");
+		return -1;
+	}
+
+	buf->handle = creq.handle;
+	buf->pitch = creq.pitch;
+	buf->size = creq.size;
+
+	/* prepare buffer for memory mapping */
+	lv_memset(&mreq, 0, sizeof(mreq));
+	mreq.handle = creq.handle;
+	ret = drmIoctl(drm_dev.fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq);
+	if (ret) {
+		err("DRM_IOCTL_MODE_MAP_DUMB fail");
+		return -1;
+	}
+
+	buf->offset = mreq.offset;
+	info("size %lu pitch %u offset %u", buf->size, buf->pitch, buf->offset);
+
+	/* perform actual memory mapping */
+	buf->map = mmap(0, creq.size, PROT_READ | PROT_WRITE, MAP_SHARED, drm_dev.fd, mreq.offset);
+	if (buf->map == MAP_FAILED) {
+		err("mmap fail");
+		return -1;
+	}
+
+	/* clear the framebuffer to 0 (= full transparency in ARGB8888) */
+	lv_memset(buf->map, 0, creq.size);
+
+	/* create framebuffer object for the dumb-buffer */
+	handles[0] = creq.handle;
+	pitches[0] = creq.pitch;
+	offsets[0] = 0;
+	ret = drmModeAddFB2(drm_dev.fd, width, height, fourcc,
+			    handles, pitches, offsets, &buf->fb_handle, 0);
+	if (ret) {
+		err("drmModeAddFB fail");
+		return -1;
+	}
+
+	return 0;
+}
+
+static bool drm_acquire_render_buf(struct drm_output *out);
+
+static int drm_allocate_buffers(struct drm_output *out)
+{
+	int ret;
+	int i;
+
+	/*Allocate DUMB buffers*/
+	for (i = 0; i < DRM_BUFFER_COUNT; i++) {
+		ret = drm_allocate_dumb(&out->drm_bufs[i], out->fb_width, out->fb_height, out->bpp, out->fourcc);
+		if (ret)
+			return ret;
+		out->drm_bufs[i].state = DRM_BUF_FREE;
+		out->drm_bufs[i].frame = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Logical (LVGL) pixel to physical pixel. LV_DISP_ROT_* and DRM_MODE_ROTATE_*
+ * both turn the picture counter-clockwise.
+ */
+static void drm_rotate_point(lv_disp_rot_t rot, int32_t w, int32_t h, int32_t *x, int32_t *y)
+{
+	int32_t lx = *x, ly = *y;
+
+	switch (rot) {
+	case LV_DISP_ROT_90:
+		*x = ly;
+		*y = w - 1 - lx;
+		break;
+	case LV_DISP_ROT_180:
+		*x = w - 1 - lx;
+		*y = h - 1 - ly;
+		break;
+	case LV_DISP_ROT_270:
+		*x = h - 1 - ly;
+		*y = lx;
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Value of the plane's rotation property for the screen rotation, 0 if the
+ * plane can't rotate like that. 180 degrees can be done by reflecting too.
+ */
+static uint64_t drm_plane_rotation(struct drm_output *out)
+{
+	static const uint64_t rotations[] = {
+		[LV_DISP_ROT_NONE] = DRM_MODE_ROTATE_0,
+		[LV_DISP_ROT_90] = DRM_MODE_ROTATE_90,
+		[LV_DISP_ROT_180] = DRM_MODE_ROTATE_180,
+		[LV_DISP_ROT_270] = DRM_MODE_ROTATE_270,
+	};
+	uint64_t supported = 0;
+	uint64_t wanted = rotations[out->rotation];
+	drmModePropertyPtr prop;
+	int i;
+
+	if (!out->plane_obj.prop_ids[DRM_PROP_ROTATION])
+		return out->rotation == LV_DISP_ROT_NONE ? DRM_MODE_ROTATE_0 : 0;
+
+	prop = drmModeGetProperty(drm_dev.fd, out->plane_obj.prop_ids[DRM_PROP_ROTATION]);
+	if (!prop)
+		return 0;
+
+	/* A bitmask property: the enum values are bit numbers */
+	for (i = 0; i < prop->count_enums; i++)
+		supported |= 1ULL << prop->enums[i].value;
+	drmModeFreeProperty(prop);
+
+	if ((supported & wanted) == wanted)
+		return wanted;
+
+	wanted = DRM_MODE_ROTATE_0 | DRM_MODE_REFLECT_X | DRM_MODE_REFLECT_Y;
+	if (out->rotation == LV_DISP_ROT_180 && (supported & wanted) == wanted)
+		return wanted;
+
+	return 0;
+}
+
+/*
+ * Ask the kernel whether the plane takes the buffers as they are: smaller
+ * than the mode and/or rotated.
+ */
+static bool drm_plane_can_transform(struct drm_output *out)
+{
+	int ret;
+
+	out->plane_rotation = drm_plane_rotation(out);
+	if (!out->plane_rotation) {
+		out->plane_rotation = DRM_MODE_ROTATE_0;
+		return false;
+	}
+
+	drmModeAtomicSetCursor(out->req, 0);
+	drm_modeset_add(out);
+	drm_plane_add(out, &out->drm_bufs[0]);
+
+	ret = drmModeAtomicCommit(drm_dev.fd, out->req,
+				  DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+
+	/* Nothing was applied */
+	drm_object_commit_done(&out->conn_obj, false);
+	drm_object_commit_done(&out->crtc_obj, false);
+	drm_object_commit_done(&out->plane_obj, false);
+
+	if (ret)
+		out->plane_rotation = DRM_MODE_ROTATE_0;
+
+	return ret == 0;
+}
+
+/*
+ * The plane can't scale or rotate: render into the shadow buffer and copy
+ * the damage scaled (nearest neighbour) and rotated into mode sized buffers.
+ * A buffer pixel (x, y) shows the shadow pixel map_col[x] + map_row[y].
+ */
+static int drm_setup_sw_transform(struct drm_output *out)
+{
+	bool swap = out->rotation == LV_DISP_ROT_90 || out->rotation == LV_DISP_ROT_270;
+	int32_t pw = swap ? out->height : out->width;  /* Render size, not rotated */
+	int32_t ph = swap ? out->width : out->height;
+	int32_t w = out->width;
+	int32_t qx, qy;
+	uint32_t i;
+
+	for (i = 0; i < DRM_BUFFER_COUNT; i++)
+		drm_free_dumb(&out->drm_bufs[i]);
+
+	out->fb_width = out->mode.hdisplay;
+	out->fb_height = out->mode.vdisplay;
+	out->sw_transform = true;
+
+	out->shadow = lv_malloc(out->width * out->height * (LV_COLOR_SIZE / 8));
+	out->map_col = lv_malloc(out->fb_width * sizeof(int32_t));
+	out->map_row = lv_malloc(out->fb_height * sizeof(int32_t));
+	out->map_line = lv_malloc(out->fb_width * sizeof(lv_color_t));
+	if (out->px_conv)
+		out->conv_line = lv_malloc(out->fb_width * (out->bpp / 8));
+	if (!out->shadow || !out->map_col || !out->map_row || !out->map_line ||
+	    (out->px_conv && !out->conv_line)) {
+		err("Cannot allocate the transformation buffers");
+		return -1;
+	}
+
+	for (i = 0; i < out->fb_width; i++) {
+		qx = i * pw / out->fb_width;
+		switch (out->rotation) {
+		case LV_DISP_ROT_90: out->map_col[i] = qx * w; break;
+		case LV_DISP_ROT_180: out->map_col[i] = pw - 1 - qx; break;
+		case LV_DISP_ROT_270: out->map_col[i] = (pw - 1 - qx) * w; break;
+		default: out->map_col[i] = qx; break;
+		}
+	}
+
+	for (i = 0; i < out->fb_height; i++) {
+		qy = i * ph / out->fb_height;
+		switch (out->rotation) {
+		case LV_DISP_ROT_90: out->map_row[i] = ph - 1 - qy; break;
+		case LV_DISP_ROT_180: out->map_row[i] = (ph - 1 - qy) * w; break;
+		case LV_DISP_ROT_270: out->map_row[i] = qy; break;
+		default: out->map_row[i] = qy * w; break;
+		}
+	}
+
+	info("drm: plane can't show %ux%u rotated by %d, transforming in software",
+	     out->width, out->height, DRM_ROTATION);
+
+	return drm_allocate_buffers(out);
+}
+
+static int drm_setup_buffers(struct drm_output *out)
+{
+	int ret;
+
+	ret = drm_allocate_buffers(out);
+	if (ret)
+		return ret;
+
+	if ((out->rotation != LV_DISP_ROT_NONE ||
+	     out->width != out->mode.hdisplay || out->height != out->mode.vdisplay) &&
+	    !drm_plane_can_transform(out)) {
+		ret = drm_setup_sw_transform(out);
+		if (ret)
+			return ret;
+	}
+
+	out->frame = 0;
+	out->last_idx = -1;
+	out->render_idx = -1;
+	drm_acquire_render_buf(out);
+
+	return 0;
+}
+
+static int drm_handle_events(int timeout)
+{
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = drm_dev.fd;
+	pfd.events = POLLIN;
+
+	do {
+		ret = poll(&pfd, 1, timeout);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret > 0) {
+		drmHandleEvent(drm_dev.fd, &drm_dev.drm_event_ctx);
+	} else if (ret < 0) {
+		err("poll failed: %s", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Copy an area between full screen sized buffers.
+ */
+static void drm_copy_area(uint8_t *dst, uint32_t dst_pitch, const uint8_t *src, uint32_t src_pitch,
+			  const lv_area_t *area)
+{
+	uint32_t offset = area->x1 * (LV_COLOR_SIZE / 8);
+	uint32_t len = lv_area_get_width(area) * (LV_COLOR_SIZE / 8);
+	lv_coord_t y;
+
+	for (y = area->y1; y <= area->y2; y++)
+		lv_memcpy(dst + dst_pitch * y + offset, src + src_pitch * y + offset, len);
+}
+
+/*
+ * Buffer pixels showing an area of the render resolution: rotate the area,
+ * then take the columns and rows whose nearest pixel is inside it.
+ */
+static void drm_fb_area(const struct drm_output *out, const lv_area_t *area, lv_area_t *fb_area)
+{
+	bool swap = out->rotation == LV_DISP_ROT_90 || out->rotation == LV_DISP_ROT_270;
+	int32_t pw = swap ? out->height : out->width;
+	int32_t ph = swap ? out->width : out->height;
+	int32_t x1 = area->x1, y1 = area->y1, x2 = area->x2, y2 = area->y2;
+
+	drm_rotate_point(out->rotation, out->width, out->height, &x1, &y1);
+	drm_rotate_point(out->rotation, out->width, out->height, &x2, &y2);
+
+	fb_area->x1 = DIV_ROUND_UP(LV_MIN(x1, x2) * out->fb_width, pw);
+	fb_area->y1 = DIV_ROUND_UP(LV_MIN(y1, y2) * out->fb_height, ph);
+	fb_area->x2 = DIV_ROUND_UP((LV_MAX(x1, x2) + 1) * out->fb_width, pw) - 1;
+	fb_area->y2 = DIV_ROUND_UP((LV_MAX(y1, y2) + 1) * out->fb_height, ph) - 1;
+}
+
+/*
+ * Copy a shadow area scaled and rotated. Each buffer row is built (and
+ * converted) once in cached memory and copied to every following row
+ * showing the same pixels.
+ */
+static void drm_transform_area(struct drm_output *out, struct drm_buffer *buf, const lv_area_t *area)
+{
+	const lv_color_t *src = (const lv_color_t *)out->shadow;
+	const uint8_t *line = out->px_conv ? out->conv_line : (const uint8_t *)out->map_line;
+	uint32_t px_size = out->bpp / 8;
+	lv_area_t dst;
+	uint32_t w;
+	int32_t row, last_row = -1;
+	lv_coord_t x, y;
+
+	drm_fb_area(out, area, &dst);
+	w = lv_area_get_width(&dst);
+
+	for (y = dst.y1; y <= dst.y2; y++) {
+		row = out->map_row[y];
+		if (row != last_row) {
+			for (x = dst.x1; x <= dst.x2; x++)
+				out->map_line[x] = src[out->map_col[x] + row];
+			if (out->px_conv)
+				out->px_conv(out->conv_line + dst.x1 * px_size, &out->map_line[dst.x1], w);
+			last_row = row;
+		}
+		lv_memcpy(buf->map + buf->pitch * y + dst.x1 * px_size, line + dst.x1 * px_size, w * px_size);
+	}
+}
+
+/*
+ * Convert a shadow area into a dumb buffer of another format.
+ */
+static void drm_convert_area(struct drm_output *out, struct drm_buffer *buf, const lv_area_t *area)
+{
+	const lv_color_t *src = (const lv_color_t *)out->shadow + area->x1;
+	uint8_t *dst = buf->map + area->x1 * (out->bpp / 8);
+	uint32_t w = lv_area_get_width(area);
+	lv_coord_t y;
+
+	for (y = area->y1; y <= area->y2; y++)
+		out->px_conv(dst + buf->pitch * y, src + out->width * y, w);
+}
+
+/*
+ * Copy an area of the shadow buffer into a dumb buffer.
+ */
+static void drm_shadow_copy(struct drm_output *out, struct drm_buffer *buf, const lv_area_t *area)
+{
+	if (out->sw_transform)
+		drm_transform_area(out, buf, area);
+	else if (out->px_conv)
+		drm_convert_area(out, buf, area);
+	else
+		drm_copy_area(buf->map, buf->pitch, out->shadow, out->width * (LV_COLOR_SIZE / 8), area);
+}
+
+/*
+ * Remember an area flushed in the current frame. A full cache drops its
+ * oldest area, buffers older than that frame get a full copy instead.
+ */
+static void drm_dmg_cache_add(struct drm_output *out, const lv_area_t *area)
+{
+	uint32_t idx;
+
+	if (out->dmg_cache.size == DRM_DMG_CACHE_CAPACITY) {
+		out->dmg_cache.lost = out->dmg_cache.frame[out->dmg_cache.start];
+		out->dmg_cache.start = (out->dmg_cache.start + 1) % DRM_DMG_CACHE_CAPACITY;
+		out->dmg_cache.size--;
+	}
+
+	idx = (out->dmg_cache.start + out->dmg_cache.size) % DRM_DMG_CACHE_CAPACITY;
+	out->dmg_cache.cache[idx] = *area;
+	out->dmg_cache.frame[idx] = out->frame + 1;
+	out->dmg_cache.size++;
+}
+
+/*
+ * Drop the areas every buffer already has.
+ */
+static void drm_dmg_cache_prune(struct drm_output *out)
+{
+	uint32_t oldest = out->frame;
+	int i;
+
+	for (i = 0; i < DRM_BUFFER_COUNT; i++) {
+		if (out->drm_bufs[i].frame < oldest)
+			oldest = out->drm_bufs[i].frame;
+	}
+
+	while (out->dmg_cache.size &&
+	       out->dmg_cache.frame[out->dmg_cache.start] <= oldest) {
+		out->dmg_cache.start = (out->dmg_cache.start + 1) % DRM_DMG_CACHE_CAPACITY;
+		out->dmg_cache.size--;
+	}
+}
+
+/*
+ * Bring a buffer up to date before rendering into it: copy the areas drawn
+ * into the other buffers since its own frame, as the buffer age in EGL terms
+ * tells which of the cached areas it misses. The shadow buffer always has
+ * the last frame and is faster to read than a dumb buffer.
+ */
+static void drm_replay_area(struct drm_output *out, struct drm_buffer *buf, const lv_area_t *area)
+{
+	const struct drm_buffer *src = &out->drm_bufs[out->last_idx];
+
+	if (out->shadow)
+		drm_shadow_copy(out, buf, area);
+	else
+		drm_copy_area(buf->map, buf->pitch, src->map, src->pitch, area);
+}
+
+static void drm_buffer_replay(struct drm_output *out, struct drm_buffer *buf)
+{
+	uint32_t i;
+
+	if (out->last_idx < 0)
+		return;
+
+	if (!out->shadow && &out->drm_bufs[out->last_idx] == buf)
+		return;
+
+	if (buf->frame == 0 || buf->frame < out->dmg_cache.lost) {
+		lv_area_t full = {0, 0, out->width - 1, out->height - 1};
+		drm_replay_area(out, buf, &full);
+		return;
+	}
+
+	for (i = 0; i < out->dmg_cache.size; i++) {
+		uint32_t idx = (out->dmg_cache.start + i) % DRM_DMG_CACHE_CAPACITY;
+		if (out->dmg_cache.frame[idx] > buf->frame)
+			drm_replay_area(out, buf, &out->dmg_cache.cache[idx]);
+	}
+}
+
+/*
+ * Pick the free buffer rendered most recently, it misses the fewest frames.
+ */
+static bool drm_acquire_render_buf(struct drm_output *out)
+{
+	int best = -1;
+	int i;
+
+	for (i = 0; i < DRM_BUFFER_COUNT; i++) {
+		if (out->drm_bufs[i].state != DRM_BUF_FREE)
+			continue;
+		if (best < 0 || out->drm_bufs[i].frame > out->drm_bufs[best].frame)
+			best = i;
+	}
+
+	if (best < 0)
+		return false;
+
+	drm_buffer_replay(out, &out->drm_bufs[best]);
+
+#if DRM_FLIP_STATS
+	lv_memset(&out->drm_bufs[best].rec, 0, sizeof(drm_flip_record_t));
+#endif
+	out->drm_bufs[best].state = DRM_BUF_RENDERING;
+	out->render_idx = best;
+
+	return true;
+}
+
+/*
+ * In direct mode make LVGL render into the acquired buffer: replace the
+ * draw buffer which doesn't hold the last frame.
+ */
+static void drm_set_render_buf(struct drm_output *out, lv_disp_drv_t *disp_drv)
+{
+	lv_disp_draw_buf_t *draw_buf = disp_drv->draw_buf;
+	uint8_t *map = out->drm_bufs[out->render_idx].map;
+	void **slot;
+
+	if (!disp_drv->direct_mode || out->shadow || out->last_idx < 0)
+		return;
+
+	slot = draw_buf->buf1 == out->drm_bufs[out->last_idx].map ? &draw_buf->buf2 : &draw_buf->buf1;
+	if (draw_buf->buf_act == *slot)
+		draw_buf->buf_act = map;
+	*slot = map;
+}
+
+static void drm_drop_frame(struct drm_output *out, struct drm_buffer *buf)
+{
+#if DRM_FLIP_STATS
+	out->stats.dropped_cnt++;
+#else
+	LV_UNUSED(out);
+#endif
+	buf->state = DRM_BUF_FREE;
+}
+
+/*
+ * Commit the newest queued frame, older queued frames are dropped.
+ * Their damage clips are still collected and sent with it.
+ */
+static void drm_commit_queued(struct drm_output *out)
+{
+	struct drm_buffer *buf = NULL;
+	int i;
+
+	for (i = 0; i < DRM_BUFFER_COUNT; i++) {
+		if (out->drm_bufs[i].state != DRM_BUF_QUEUED)
+			continue;
+		if (buf && buf->frame > out->drm_bufs[i].frame) {
+			drm_drop_frame(out, &out->drm_bufs[i]);
+			continue;
+		}
+		if (buf)
+			drm_drop_frame(out, buf);
+		buf = &out->drm_bufs[i];
+	}
+
+	if (buf && out->disconnected) {
+		drm_drop_frame(out, buf);
+		return;
+	}
+
+	if (!buf) {
+		/* Nothing to show, but the cursor or a layer might have changed */
+		bool changed = out->cursor.dirty;
+#if DRM_MAX_LAYERS > 0
+		changed = changed || drm_layers_pending(out);
+#endif
+		if (changed && out->modeset_done)
+			drm_dmabuf_set_plane(out, NULL);
+		return;
+	}
+
+	/*Request buffer swap*/
+	if (drm_dmabuf_set_plane(out, buf)) {
+		err("Flush fail");
+#if DRM_FLIP_STATS
+		out->stats.failed_cnt++;
+#endif
+		buf->state = DRM_BUF_FREE;
+		return;
+	}
+
+	dbg("Flush done");
+	buf->state = DRM_BUF_FLIPPING;
+}
+
+#if DRM_FLIP_STATS
+/*
+ * Account a frame which was just shown. Without monotonic flip timestamps
+ * the time the event is handled is used instead.
+ */
+static void drm_flip_stats_add(struct drm_output *out, struct drm_buffer *buf)
+{
+	drm_flip_stats_t *stats = &out->stats;
+	drm_flip_record_t *rec = &buf->rec;
+	uint32_t latency, flip;
+	uint32_t bucket = 0;
+
+	rec->flip_ns = drm_dev.monotonic && out->vblank_ns ? out->vblank_ns : drm_time_ns();
+	rec->vblank_delta = out->flip_seq_delta;
+	if (!rec->flush_ns)
+		rec->flush_ns = rec->commit_ns;
+
+	latency = drm_ns32(rec->flip_ns > rec->flush_ns ? rec->flip_ns - rec->flush_ns : 0);
+	flip = drm_ns32(rec->flip_ns > rec->commit_ns ? rec->flip_ns - rec->commit_ns : 0);
+
+	while (bucket < 31 && (latency >> (bucket + 1)) != 0)
+		bucket++;
+
+	stats->frame_cnt++;
+	stats->commit_ns += rec->commit_dur_ns;
+	stats->max_commit_ns = LV_MAX(stats->max_commit_ns, rec->commit_dur_ns);
+	stats->latency_ns += latency;
+	stats->max_latency_ns = LV_MAX(stats->max_latency_ns, latency);
+	stats->hist[bucket]++;
+
+	/* A commit is shown at the next vblank, every further period is a missed one */
+	if (out->period_ns && flip > out->period_ns + out->period_ns / 8) {
+		stats->late_cnt++;
+		stats->missed_vblanks += (flip - out->period_ns / 8) / out->period_ns;
+	}
+
+#if DRM_FLIP_LOG > 0
+	out->log[out->log_cnt++ % DRM_FLIP_LOG] = *rec;
+#endif
+}
+
+static void drm_flip_stats_wait(struct drm_output *out, uint64_t ns)
+{
+	uint32_t ns32 = drm_ns32(ns);
+
+	out->stats.wait_ns += ns;
+	out->stats.max_wait_ns = LV_MAX(out->stats.max_wait_ns, ns32);
+	out->drm_bufs[out->render_idx].rec.wait_ns = ns32;
+}
+#endif
+
+static void drm_flip_done(struct drm_output *out)
+{
+	bool flipped = false;
+	int i;
+
+	out->flip_pending = false;
+
+	/* Commits without a frame (cursor or layers only) leave the shown buffer on screen */
+	for (i = 0; i < DRM_BUFFER_COUNT; i++) {
+		if (out->drm_bufs[i].state == DRM_BUF_FLIPPING)
+			flipped = true;
+	}
+	for (i = 0; i < DRM_BUFFER_COUNT && flipped; i++) {
+		if (out->drm_bufs[i].state == DRM_BUF_SCANOUT)
+			out->drm_bufs[i].state = DRM_BUF_FREE;
+	}
+	for (i = 0; i < DRM_BUFFER_COUNT; i++) {
+		if (out->drm_bufs[i].state != DRM_BUF_FLIPPING)
+			continue;
+#if DRM_FLIP_STATS
+		drm_flip_stats_add(out, &out->drm_bufs[i]);
+#endif
+		out->drm_bufs[i].state = DRM_BUF_SCANOUT;
+	}
+#if DRM_MAX_LAYERS > 0
+	drm_layers_flip_done(out);
+#endif
+
+#if DRM_CAPTURE
+	if (out->capture.active)
+		drm_capture_poll(out, 0);
+#endif
+
+	drm_commit_queued(out);
+}
+
+/*
+ * Displays set up by drm_output_disp_drv_init() carry their output, the ones
+ * set up by hand use the first output like before.
+ */
+static struct drm_output *drm_drv_output(lv_disp_drv_t *disp_drv)
+{
+	return disp_drv->user_data ? disp_drv->user_data : &drm_dev.outputs[0];
+}
+
+void drm_wait_vsync(lv_disp_drv_t * disp_drv)
+{
+	struct drm_output *out = drm_drv_output(disp_drv);
+#if DRM_FLIP_STATS
+	uint64_t t_wait = out->render_idx < 0 ? drm_time_ns() : 0;
+#endif
+
+	/* Block until a flip frees a buffer, flips of other outputs are handled meanwhile */
+	while(out->render_idx < 0 && !drm_acquire_render_buf(out)) {
+		if (drm_handle_events(-1))
+			return;
+	}
+
+#if DRM_FLIP_STATS
+	if (t_wait)
+		drm_flip_stats_wait(out, drm_time_ns() - t_wait);
+#endif
+
+	drm_set_render_buf(out, disp_drv);
+	lv_disp_flush_ready(disp_drv);
+}
+
+void drm_flush(lv_disp_drv_t * disp_drv, const lv_area_t * area, lv_color_t * color_p)
+{
+	struct drm_output *out = drm_drv_output(disp_drv);
+	struct drm_buffer *fbuf = &out->drm_bufs[out->render_idx];
+
+#if DRM_FLIP_STATS
+	if (!fbuf->rec.flush_ns)
+		fbuf->rec.flush_ns = drm_time_ns();
+#endif
+
+	if (out->shadow) {
+		/* Write only the flushed area into the (usually write-combined) dumb buffer */
+		drm_shadow_copy(out, fbuf, area);
+	} else if(!disp_drv->direct_mode) {
+		/*Backwards compatibility: Non-direct flush */
+		uint32_t w = (area->x2 - area->x1) + 1;
+		for (int y = 0, i = area->y1; i <= area->y2 ; ++i, ++y) {
+			if (out->px_conv) {
+				out->px_conv(fbuf->map + area->x1 * (out->bpp / 8) + fbuf->pitch * i, color_p + w * y, w);
+				continue;
+			}
+			lv_memcpy(fbuf->map + (area->x1 * (LV_COLOR_SIZE / 8)) + (fbuf->pitch * i),
+			          (uint8_t *)color_p + (w * (LV_COLOR_SIZE / 8) * y),
+			          w * (LV_COLOR_SIZE / 8));
+		}
+	}
+
+#if DRM_DAMAGE_CLIPS > 0
+	if (out->sw_transform) {
+		lv_area_t fb_area;
+		drm_fb_area(out, area, &fb_area);
+		drm_damage_add(out, &fb_area);
+	} else {
+		drm_damage_add(out, area);
+	}
+#endif
+
+	drm_dmg_cache_add(out, area);
+
+	if(!lv_disp_flush_is_last(disp_drv)) {
+		lv_disp_flush_ready(disp_drv);
+		return;
+	}
+
+	if (out->render_start) {
+		uint64_t now = drm_time_ns();
+		/* Frames not started right after the wake up don't tell the render time */
+		if (now > out->render_start && now - out->render_start < 2 * out->period_ns)
+			out->render_ns = out->render_ns ? (out->render_ns * 7 + now - out->render_start) / 8
+							: now - out->render_start;
+		out->render_start = 0;
+	}
+
+	/* Queue the frame, it is committed now or when the pending flip completes */
+	fbuf->state = DRM_BUF_QUEUED;
+	fbuf->frame = ++out->frame;
+#if DRM_FLIP_STATS
+	fbuf->rec.frame = fbuf->frame;
+#endif
+	out->last_idx = out->render_idx;
+	out->render_idx = -1;
+	drm_dmg_cache_prune(out);
+
+	if (!out->flip_pending)
+		drm_commit_queued(out);
+
+	/* Go on rendering if a buffer is free, otherwise wait in drm_wait_vsync() */
+	drm_handle_events(0);
+	if (drm_acquire_render_buf(out)) {
+		drm_set_render_buf(out, disp_drv);
+		lv_disp_flush_ready(disp_drv);
+	}
+}
+
+/*
+ * Cursor position in CRTC pixels, LVGL works at the render resolution and
+ * maybe rotated. The hot spot is rotated with the image already.
+ */
+static void drm_cursor_pos(const struct drm_output *out, int32_t *x, int32_t *y)
+{
+	bool swap = out->rotation == LV_DISP_ROT_90 || out->rotation == LV_DISP_ROT_270;
+	int32_t pw = swap ? out->height : out->width;
+	int32_t ph = swap ? out->width : out->height;
+
+	*x = out->cursor.x;
+	*y = out->cursor.y;
+	drm_rotate_point(out->rotation, out->width, out->height, x, y);
+	*x = *x * (int32_t)out->mode.hdisplay / pw - out->cursor.hot_x;
+	*y = *y * (int32_t)out->mode.vdisplay / ph - out->cursor.hot_y;
+}
+
+/*
+ * Add the cursor plane to the commit if it changed.
+ */
+static void drm_cursor_add(struct drm_output *out)
+{
+	struct drm_object *obj = &out->cursor.obj;
+	int32_t x, y;
+
+	if (!out->cursor.plane_id || !out->cursor.dirty)
+		return;
+
+	if (!out->cursor.visible) {
+		drm_object_set(out->req, obj, DRM_PROP_FB_ID, 0);
+		drm_object_set(out->req, obj, DRM_PROP_CRTC_ID, 0);
+		return;
+	}
+
+	drm_object_set(out->req, obj, DRM_PROP_FB_ID, out->cursor.buf.fb_handle);
+	drm_object_set(out->req, obj, DRM_PROP_CRTC_ID, out->crtc_id);
+	drm_object_set(out->req, obj, DRM_PROP_SRC_X, 0);
+	drm_object_set(out->req, obj, DRM_PROP_SRC_Y, 0);
+	drm_object_set(out->req, obj, DRM_PROP_SRC_W, out->cursor.width << 16);
+	drm_object_set(out->req, obj, DRM_PROP_SRC_H, out->cursor.height << 16);
+	/* CRTC_X/Y are signed, the cursor can be partly off screen */
+	drm_cursor_pos(out, &x, &y);
+	drm_object_set(out->req, obj, DRM_PROP_CRTC_X, (uint64_t)(int64_t)x);
+	drm_object_set(out->req, obj, DRM_PROP_CRTC_Y, (uint64_t)(int64_t)y);
+	drm_object_set(out->req, obj, DRM_PROP_CRTC_W, out->cursor.width);
+	drm_object_set(out->req, obj, DRM_PROP_CRTC_H, out->cursor.height);
+}
+
+/*
+ * Commit a cursor change right away if no flip is pending, otherwise it goes
+ * with the next frame or after the flip completes.
+ */
+static void drm_cursor_update(struct drm_output *out)
+{
+	int32_t x, y;
+
+	if (!out->cursor.plane_id) {
+		if (out->cursor.visible) {
+			drm_cursor_pos(out, &x, &y);
+			drmModeMoveCursor(drm_dev.fd, out->crtc_id, x, y);
+		}
+		return;
+	}
+
+	out->cursor.dirty = true;
+	if (!out->flip_pending && out->modeset_done)
+		drm_dmabuf_set_plane(out, NULL);
+}
+
+/*
+ * Find the cursor plane of the CRTC and allocate the cursor buffer. Without a
+ * cursor plane the legacy cursor ioctls are used with the same buffer.
+ */
+static int drm_cursor_setup(struct drm_output *out)
+{
+	uint64_t width = 64, height = 64;
+
+	if (drmGetCap(drm_dev.fd, DRM_CAP_CURSOR_WIDTH, &width) || !width)
+		width = 64;
+	if (drmGetCap(drm_dev.fd, DRM_CAP_CURSOR_HEIGHT, &height) || !height)
+		height = 64;
+
+	out->cursor.width = width;
+	out->cursor.height = height;
+
+	if (find_plane(DRM_FORMAT_ARGB8888, &out->cursor.plane_id, out->crtc_idx, DRM_PLANE_TYPE_CURSOR) == 0) {
+		if (drm_object_init(&out->cursor.obj, out->cursor.plane_id, DRM_MODE_OBJECT_PLANE)) {
+			err("Cannot get cursor plane props");
+			out->cursor.plane_id = 0;
+		}
+	} else {
+		out->cursor.plane_id = 0;
+	}
+
+	if (drm_allocate_dumb(&out->cursor.buf, out->cursor.width, out->cursor.height, 32,
+			      DRM_FORMAT_ARGB8888)) {
+		err("Cannot allocate the cursor buffer");
+		drm_free_dumb(&out->cursor.buf);
+		out->cursor.plane_id = 0;
+		return -1;
+	}
+
+	info("drm: %ux%u cursor on %s", out->cursor.width, out->cursor.height,
+	     out->cursor.plane_id ? "plane" : "legacy cursor");
+
+	out->cursor.ready = true;
+	return 0;
+}
+
+/*
+ * Convert an image into the premultiplied ARGB8888 cursor buffer, rotated
+ * like the screen. The part not fitting into the cursor size is cut off.
+ */
+static int drm_cursor_load(struct drm_output *out, const lv_img_dsc_t *img)
+{
+	int32_t w = img->header.w;
+	int32_t h = img->header.h;
+	int32_t x, y;
+
+	if (img->header.cf != LV_IMG_CF_TRUE_COLOR && img->header.cf != LV_IMG_CF_TRUE_COLOR_ALPHA) {
+		err("Cursor images must be LV_IMG_CF_TRUE_COLOR(_ALPHA)");
+		return -1;
+	}
+
+	if (LV_MAX(w, h) > (int32_t)LV_MIN(out->cursor.width, out->cursor.height))
+		info("drm: cursor image might be cut to %ux%u", out->cursor.width, out->cursor.height);
+
+	lv_memset(out->cursor.buf.map, 0, out->cursor.buf.size);
+
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++) {
+			uint32_t i = y * w + x;
+			int32_t dx = x, dy = y;
+			lv_color_t c;
+			uint32_t c32, a = 0xff;
+
+			drm_rotate_point(out->rotation, w, h, &dx, &dy);
+			if (dx >= (int32_t)out->cursor.width || dy >= (int32_t)out->cursor.height)
+				continue;
+
+			if (img->header.cf == LV_IMG_CF_TRUE_COLOR_ALPHA) {
+				const uint8_t *px = (const uint8_t *)img->data + i * LV_IMG_PX_SIZE_ALPHA_BYTE;
+				lv_memcpy(&c, px, sizeof(c));
+				a = px[LV_IMG_PX_SIZE_ALPHA_BYTE - 1];
+			} else {
+				c = ((const lv_color_t *)img->data)[i];
+			}
+
+			c32 = lv_color_to32(c);
+			((uint32_t *)(out->cursor.buf.map + out->cursor.buf.pitch * dy))[dx] = a << 24 |
+				 (((c32 >> 16) & 0xff) * a / 255) << 16 |
+				 (((c32 >> 8) & 0xff) * a / 255) << 8 |
+				 ((c32 & 0xff) * a / 255);
+		}
+	}
+
+	return 0;
+}
+
+int drm_output_set_cursor(drm_output_t *out, const lv_img_dsc_t *img, lv_coord_t hot_x, lv_coord_t hot_y)
+{
+	int32_t hx = hot_x, hy = hot_y;
+
+	if (!img) {
+		out->cursor.visible = false;
+		if (!out->cursor.ready)
+			return 0;
+		if (!out->cursor.plane_id)
+			drmModeSetCursor2(drm_dev.fd, out->crtc_id, 0, 0, 0, 0, 0);
+		drm_cursor_update(out);
+		return 0;
+	}
+
+	if (!out->cursor.ready && drm_cursor_setup(out))
+		return -1;
+
+	if (drm_cursor_load(out, img))
+		return -1;
+
+	drm_rotate_point(out->rotation, img->header.w, img->header.h, &hx, &hy);
+	out->cursor.hot_x = hx;
+	out->cursor.hot_y = hy;
+	out->cursor.visible = true;
+
+	if (!out->cursor.plane_id &&
+	    drmModeSetCursor2(drm_dev.fd, out->crtc_id, out->cursor.buf.handle, out->cursor.width,
+			      out->cursor.height, hx, hy)) {
+		err("drmModeSetCursor2 failed: %s", strerror(errno));
+		return -1;
+	}
+
+	drm_cursor_update(out);
+	return 0;
+}
+
+void drm_output_move_cursor(drm_output_t *out, lv_coord_t x, lv_coord_t y)
+{
+	if (out->cursor.x == x && out->cursor.y == y)
+		return;
+
+	out->cursor.x = x;
+	out->cursor.y = y;
+
+	if (out->cursor.visible)
+		drm_cursor_update(out);
+}
+
+#if DRM_MAX_LAYERS > 0
+/* Layer buffers in order of preference, transparent pixels show the planes below */
+static const uint32_t drm_layer_formats[] = {
+#if LV_COLOR_DEPTH == 32
+	DRM_FORMAT_ARGB8888,
+	DRM_FORMAT_XRGB8888,
+#else
+	DRM_FORMAT_RGB565,
+#endif
+};
+
+static const lv_area_t drm_no_area = {0, 0, -1, -1};
+
+static void drm_area_add(lv_area_t *a, const lv_area_t *b)
+{
+	if (b->x1 > b->x2)
+		return;
+	if (a->x1 > a->x2)
+		*a = *b;
+	else
+		_lv_area_join(a, a, b);
+}
+
+/*
+ * The newest buffer given to the plane or queued for it, NULL if none.
+ */
+static struct drm_buffer *drm_layer_newest(struct drm_layer *layer)
+{
+	struct drm_buffer *buf = NULL;
+	int i;
+
+	for (i = 0; i < DRM_LAYER_BUFFERS; i++) {
+		if (layer->bufs[i].state != DRM_BUF_FREE && (!buf || layer->bufs[i].frame > buf->frame))
+			buf = &layer->bufs[i];
+	}
+
+	return buf;
+}
+
+static void drm_layer_add(struct drm_layer *layer, struct drm_buffer *buf)
+{
+	struct drm_output *out = layer->out;
+	struct drm_object *obj = &layer->obj;
+
+	if (!layer->visible || !buf) {
+		drm_object_set(out->req, obj, DRM_PROP_FB_ID, 0);
+		drm_object_set(out->req, obj, DRM_PROP_CRTC_ID, 0);
+		return;
+	}
+
+	drm_object_set(out->req, obj, DRM_PROP_FB_ID, buf->fb_handle);
+	drm_object_set(out->req, obj, DRM_PROP_CRTC_ID, out->crtc_id);
+	drm_object_set(out->req, obj, DRM_PROP_SRC_X, 0);
+	drm_object_set(out->req, obj, DRM_PROP_SRC_Y, 0);
+	drm_object_set(out->req, obj, DRM_PROP_SRC_W, layer->width << 16);
+	drm_object_set(out->req, obj, DRM_PROP_SRC_H, layer->height << 16);
+	drm_object_set(out->req, obj, DRM_PROP_CRTC_X, (uint64_t)(int64_t)layer->x);
+	drm_object_set(out->req, obj, DRM_PROP_CRTC_Y, (uint64_t)(int64_t)layer->y);
+	drm_object_set(out->req, obj, DRM_PROP_CRTC_W, layer->width);
+	drm_object_set(out->req, obj, DRM_PROP_CRTC_H, layer->height);
+	if (obj->prop_ids[DRM_PROP_ZPOS])
+		drm_object_set(out->req, obj, DRM_PROP_ZPOS, layer->zpos);
+}
+
+static bool drm_layer_queued(struct drm_layer *layer)
+{
+	int i;
+
+	for (i = 0; i < DRM_LAYER_BUFFERS; i++) {
+		if (layer->bufs[i].state == DRM_BUF_QUEUED)
+			return true;
+	}
+
+	return false;
+}
+
+static bool drm_layers_pending(struct drm_output *out)
+{
+	int i;
+
+	for (i = 0; i < DRM_MAX_LAYERS; i++) {
+		if (out->layers[i].out && (out->layers[i].dirty || drm_layer_queued(&out->layers[i])))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Add the layers with a new frame or position to the commit of the output.
+ */
+static void drm_layers_add(struct drm_output *out)
+{
+	struct drm_layer *layer;
+	int i;
+
+	for (i = 0; i < DRM_MAX_LAYERS; i++) {
+		layer = &out->layers[i];
+		if (layer->out && (layer->dirty || drm_layer_queued(layer)))
+			drm_layer_add(layer, drm_layer_newest(layer));
+	}
+}
+
+/*
+ * The queued frames were committed or, like the output's own, dropped.
+ */
+static void drm_layers_commit_done(struct drm_output *out, bool success)
+{
+	struct drm_layer *layer;
+	int i, j;
+
+	for (i = 0; i < DRM_MAX_LAYERS; i++) {
+		layer = &out->layers[i];
+		for (j = 0; j < DRM_LAYER_BUFFERS; j++) {
+			if (layer->bufs[j].state == DRM_BUF_QUEUED)
+				layer->bufs[j].state = success ? DRM_BUF_FLIPPING : DRM_BUF_FREE;
+		}
+		if (success)
+			layer->dirty = false;
+	}
+}
+
+static void drm_layers_flip_done(struct drm_output *out)
+{
+	struct drm_layer *layer;
+	int i, j;
+
+	for (i = 0; i < DRM_MAX_LAYERS; i++) {
+		layer = &out->layers[i];
+		for (j = 0; j < DRM_LAYER_BUFFERS && layer->bufs[j].state != DRM_BUF_FLIPPING; j++)
+			;
+		if (j == DRM_LAYER_BUFFERS)
+			continue;
+
+		for (j = 0; j < DRM_LAYER_BUFFERS; j++) {
+			if (layer->bufs[j].state == DRM_BUF_SCANOUT)
+				layer->bufs[j].state = DRM_BUF_FREE;
+			else if (layer->bufs[j].state == DRM_BUF_FLIPPING)
+				layer->bufs[j].state = DRM_BUF_SCANOUT;
+		}
+	}
+}
+
+/*
+ * The output was turned off: the newest frame of every layer is shown again
+ * with the next modeset.
+ */
+static void drm_layers_reset(struct drm_output *out)
+{
+	struct drm_buffer *newest;
+	struct drm_layer *layer;
+	int i, j;
+
+	for (i = 0; i < DRM_MAX_LAYERS; i++) {
+		layer = &out->layers[i];
+		newest = drm_layer_newest(layer);
+		for (j = 0; j < DRM_LAYER_BUFFERS; j++)
+			layer->bufs[j].state = DRM_BUF_FREE;
+		if (newest)
+			newest->state = DRM_BUF_QUEUED;
+		layer->dirty = true;
+	}
+}
+
+/*
+ * A buffer to put the frame into: the queued one isn't shown yet, so it can
+ * take the newer frame. -1 if both are given to the plane.
+ */
+static int drm_layer_target(struct drm_layer *layer)
+{
+	int i;
+
+	for (i = 0; i < DRM_LAYER_BUFFERS; i++) {
+		if (layer->bufs[i].state == DRM_BUF_QUEUED)
+			return i;
+	}
+
+	for (i = 0; i < DRM_LAYER_BUFFERS; i++) {
+		if (layer->bufs[i].state == DRM_BUF_FREE)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * LVGL renders a layer into its cached shadow buffer. Once a frame is done
+ * the areas the target buffer misses are copied, the other buffer gets them
+ * when it is used next.
+ */
+static void drm_layer_flush(lv_disp_drv_t *disp_drv, const lv_area_t *area, lv_color_t *color_p)
+{
+	struct drm_layer *layer = disp_drv->user_data;
+	struct drm_output *out = layer->out;
+	struct drm_buffer *buf;
+	int idx, i;
+
+	LV_UNUSED(color_p);
+
+	drm_area_add(&layer->frame_area, area);
+
+	if (!lv_disp_flush_is_last(disp_drv)) {
+		lv_disp_flush_ready(disp_drv);
+		return;
+	}
+
+	/* Both buffers are busy only while a flip is pending */
+	while ((idx = drm_layer_target(layer)) < 0) {
+		if (drm_handle_events(-1))
+			break;
+	}
+
+	for (i = 0; i < DRM_LAYER_BUFFERS; i++)
+		drm_area_add(&layer->stale[i], &layer->frame_area);
+	layer->frame_area = drm_no_area;
+
+	if (idx >= 0) {
+		buf = &layer->bufs[idx];
+		if (layer->stale[idx].x1 <= layer->stale[idx].x2)
+			drm_copy_area(buf->map, buf->pitch, (const uint8_t *)layer->shadow,
+				      layer->width * (LV_COLOR_SIZE / 8), &layer->stale[idx]);
+		layer->stale[idx] = drm_no_area;
+		buf->state = DRM_BUF_QUEUED;
+		buf->frame = ++layer->frame;
+
+		if (!out->flip_pending)
+			drm_commit_queued(out);
+	}
+
+	lv_disp_flush_ready(disp_drv);
+}
+
+/*
+ * Ask the kernel whether the plane can show the layer where it is.
+ */
+static int drm_layer_test(struct drm_layer *layer)
+{
+	struct drm_output *out = layer->out;
+	bool modeset = !out->modeset_done;
+	int ret;
+
+	drmModeAtomicSetCursor(out->req, 0);
+	if (modeset) {
+		drm_modeset_add(out);
+		drm_plane_add(out, &out->drm_bufs[0]);
+	}
+	drm_layer_add(layer, &layer->bufs[0]);
+
+	ret = drmModeAtomicCommit(drm_dev.fd, out->req,
+				  DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+
+	/* Nothing was applied */
+	if (modeset) {
+		drm_object_commit_done(&out->conn_obj, false);
+		drm_object_commit_done(&out->crtc_obj, false);
+		drm_object_commit_done(&out->plane_obj, false);
+	}
+	drm_object_commit_done(&layer->obj, false);
+
+	return ret;
+}
+
+static void drm_layer_free(struct drm_layer *layer)
+{
+	int i;
+
+	for (i = 0; i < DRM_LAYER_BUFFERS; i++)
+		drm_free_dumb(&layer->bufs[i]);
+	lv_free(layer->shadow);
+
+	lv_memset(layer, 0, sizeof(*layer));
+}
+
+/*
+ * Commit a position or visibility change right away if no flip is pending,
+ * otherwise it goes with the next frame or after the flip completes.
+ */
+static void drm_layer_update(struct drm_layer *layer)
+{
+	layer->dirty = true;
+	if (!layer->out->flip_pending)
+		drm_commit_queued(layer->out);
+}
+
+lv_disp_t * drm_output_create_layer(drm_output_t *out, lv_coord_t x, lv_coord_t y, lv_coord_t w, lv_coord_t h,
+				    uint32_t zpos)
+{
+	struct drm_layer *layer = NULL;
+	drmModePropertyPtr prop;
+	lv_disp_t *disp;
+	uint32_t i;
+
+	if (w <= 0 || h <= 0)
+		return NULL;
+
+	for (i = 0; i < DRM_MAX_LAYERS && !layer; i++) {
+		if (!out->layers[i].out)
+			layer = &out->layers[i];
+	}
+	if (!layer) {
+		err("No free layer, raise DRM_MAX_LAYERS");
+		return NULL;
+	}
+
+	lv_memset(layer, 0, sizeof(*layer));
+	for (i = 0; i < sizeof(drm_layer_formats) / sizeof(drm_layer_formats[0]); i++) {
+		if (find_plane(drm_layer_formats[i], &layer->plane_id, out->crtc_idx, DRM_PLANE_TYPE_OVERLAY) == 0)
+			break;
+	}
+	if (i == sizeof(drm_layer_formats) / sizeof(drm_layer_formats[0])) {
+		err("No free overlay plane for connector %u", out->conn_id);
+		return NULL;
+	}
+
+	layer->out = out;
+	layer->fourcc = drm_layer_formats[i];
+	layer->x = x;
+	layer->y = y;
+	layer->width = w;
+	layer->height = h;
+	layer->zpos = zpos;
+	layer->visible = true;
+	layer->dirty = true;
+	layer->frame_area = drm_no_area;
+	for (i = 0; i < DRM_LAYER_BUFFERS; i++)
+		layer->stale[i] = drm_no_area;
+
+	if (drm_object_init(&layer->obj, layer->plane_id, DRM_MODE_OBJECT_PLANE)) {
+		err("Cannot get plane props");
+		goto err;
+	}
+
+	/* Some drivers have a fixed stacking order */
+	if (layer->obj.prop_ids[DRM_PROP_ZPOS]) {
+		prop = drmModeGetProperty(drm_dev.fd, layer->obj.prop_ids[DRM_PROP_ZPOS]);
+		if (prop && (prop->flags & DRM_MODE_PROP_IMMUTABLE))
+			layer->obj.prop_ids[DRM_PROP_ZPOS] = 0;
+		if (prop)
+			drmModeFreeProperty(prop);
+	}
+
+	for (i = 0; i < DRM_LAYER_BUFFERS; i++) {
+		if (drm_allocate_dumb(&layer->bufs[i], w, h, LV_COLOR_DEPTH, layer->fourcc))
+			goto err;
+		layer->bufs[i].state = DRM_BUF_FREE;
+	}
+
+	layer->shadow = lv_malloc(w * h * (LV_COLOR_SIZE / 8));
+	if (!layer->shadow) {
+		err("Cannot allocate the layer buffer");
+		goto err;
+	}
+	lv_memset(layer->shadow, 0, w * h * (LV_COLOR_SIZE / 8));
+
+	if (drm_layer_test(layer)) {
+		err("Plane %u can't show %dx%d at %d,%d: %s", layer->plane_id, w, h, x, y, strerror(errno));
+		goto err;
+	}
+
+	lv_disp_drv_init(&layer->disp_drv);
+	lv_disp_draw_buf_init(&layer->draw_buf, layer->shadow, NULL, w * h);
+	layer->disp_drv.draw_buf = &layer->draw_buf;
+	layer->disp_drv.direct_mode = true;
+	layer->disp_drv.hor_res = w;
+	layer->disp_drv.ver_res = h;
+	layer->disp_drv.flush_cb = drm_layer_flush;
+	layer->disp_drv.user_data = layer;
+#if LV_COLOR_SCREEN_TRANSP
+	layer->disp_drv.screen_transp = layer->fourcc == DRM_FORMAT_ARGB8888;
+#endif
+
+	disp = lv_disp_drv_register(&layer->disp_drv);
+	if (!disp)
+		goto err;
+
+	info("drm: layer %dx%d at %d,%d on plane %u, zpos %u", w, h, x, y, layer->plane_id, zpos);
+
+	return disp;
+
+err:
+	drm_layer_free(layer);
+	return NULL;
+}
+
+int drm_layer_set_pos(lv_disp_t *disp, lv_coord_t x, lv_coord_t y)
+{
+	struct drm_layer *layer = disp->driver->user_data;
+	int32_t old_x = layer->x, old_y = layer->y;
+
+	if (x == old_x && y == old_y)
+		return 0;
+
+	layer->x = x;
+	layer->y = y;
+	if (layer->visible && drm_layer_test(layer)) {
+		err("Plane %u can't show the layer at %d,%d", layer->plane_id, x, y);
+		layer->x = old_x;
+		layer->y = old_y;
+		return -1;
+	}
+
+	drm_layer_update(layer);
+	return 0;
+}
+
+void drm_layer_set_visible(lv_disp_t *disp, bool visible)
+{
+	struct drm_layer *layer = disp->driver->user_data;
+
+	if (layer->visible == visible)
+		return;
+
+	layer->visible = visible;
+	drm_layer_update(layer);
+}
+#endif
+
+#if DRM_CAPTURE
+static bool drm_writeback_in_use(uint32_t conn_id)
+{
+	uint32_t i;
+
+	for (i = 0; i < drm_dev.output_cnt; i++) {
+		if (drm_dev.outputs[i].capture.obj.id == conn_id)
+			return true;
+	}
+
+	return false;
+}
+
+static bool drm_writeback_takes_xrgb8888(uint32_t conn_id)
+{
+	drmModeObjectPropertiesPtr props;
+	drmModePropertyPtr prop;
+	drmModePropertyBlobPtr blob;
+	bool found = false;
+	uint32_t i, j;
+
+	props = drmModeObjectGetProperties(drm_dev.fd, conn_id, DRM_MODE_OBJECT_CONNECTOR);
+	if (!props)
+		return false;
+
+	for (i = 0; i < props->count_props && !found; i++) {
+		prop = drmModeGetProperty(drm_dev.fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		if (!strcmp(prop->name, "WRITEBACK_PIXEL_FORMATS")) {
+			blob = drmModeGetPropertyBlob(drm_dev.fd, props->prop_values[i]);
+			for (j = 0; blob && j < blob->length / sizeof(uint32_t); j++) {
+				if (((const uint32_t *)blob->data)[j] == DRM_FORMAT_XRGB8888)
+					found = true;
+			}
+			if (blob)
+				drmModeFreePropertyBlob(blob);
+		}
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+
+	return found;
+}
+
+/*
+ * Find a free writeback connector which can be attached to the CRTC of the
+ * output and writes XRGB8888, 0 if there is none.
+ */
+static uint32_t drm_find_writeback(struct drm_output *out)
+{
+	drmModeConnector *conn;
+	drmModeEncoder *enc;
+	drmModeRes *res;
+	uint32_t conn_id = 0;
+	int i, j;
+
+	res = drmModeGetResources(drm_dev.fd);
+	if (!res) {
+		err("drmModeGetResources() failed");
+		return 0;
+	}
+
+	for (i = 0; i < res->count_connectors && !conn_id; i++) {
+		conn = drmModeGetConnector(drm_dev.fd, res->connectors[i]);
+		if (!conn)
+			continue;
+
+		if (conn->connector_type == DRM_MODE_CONNECTOR_WRITEBACK &&
+		    !drm_writeback_in_use(conn->connector_id) &&
+		    drm_writeback_takes_xrgb8888(conn->connector_id)) {
+			for (j = 0; j < conn->count_encoders && !conn_id; j++) {
+				enc = drmModeGetEncoder(drm_dev.fd, conn->encoders[j]);
+				if (!enc)
+					continue;
+				if (enc->possible_crtcs & (1 << out->crtc_idx))
+					conn_id = conn->connector_id;
+				drmModeFreeEncoder(enc);
+			}
+		}
+		drmModeFreeConnector(conn);
+	}
+
+	drmModeFreeResources(res);
+
+	return conn_id;
+}
+
+/*
+ * Attach the writeback connector to the CRTC while capturing, returns
+ * whether that changes.
+ */
+static bool drm_capture_attach(struct drm_output *out)
+{
+	struct drm_capture *cap = &out->capture;
+
+	if (!cap->obj.id)
+		return false;
+
+	drm_object_set(out->req, &cap->obj, DRM_PROP_CRTC_ID, cap->active ? out->crtc_id : 0);
+
+	return cap->obj.pending & (1U << DRM_PROP_CRTC_ID);
+}
+
+/*
+ * Let the display engine write a selected frame into a free capture buffer,
+ * the kernel returns a fence for it. Frames are skipped while both buffers
+ * are still being written.
+ */
+static void drm_capture_add(struct drm_output *out, struct drm_buffer *buf)
+{
+	struct drm_capture *cap = &out->capture;
+	int i;
+
+	if (!cap->active || !(cap->next || (cap->interval && buf->frame % cap->interval == 0)))
+		return;
+
+	drm_capture_poll(out, 0);
+
+	for (i = 0; i < DRM_CAPTURE_BUFFERS && cap->fence[i] >= 0; i++)
+		;
+	if (i == DRM_CAPTURE_BUFFERS)
+		return;
+
+	drm_object_set(out->req, &cap->obj, DRM_PROP_WRITEBACK_FB_ID, cap->bufs[i].fb_handle);
+	drm_object_set(out->req, &cap->obj, DRM_PROP_WRITEBACK_OUT_FENCE_PTR, (uintptr_t)&cap->fence[i]);
+	cap->frame[i] = buf->frame;
+	cap->next = false;
+}
+
+static void drm_capture_write_ppm(const char *path_fmt, const drm_capture_frame_t *frame)
+{
+	char path[256];
+	const uint8_t *src;
+	uint8_t *row;
+	uint32_t x, y;
+	FILE *f;
+
+	snprintf(path, sizeof(path), path_fmt, frame->frame);
+
+	row = lv_malloc(frame->width * 3);
+	f = row ? fopen(path, "wb") : NULL;
+	if (!f) {
+		err("Cannot write %s: %s", path, strerror(errno));
+		lv_free(row);
+		return;
+	}
+
+	fprintf(f, "P6\n%u %u\n255\n", frame->width, frame->height);
+	for (y = 0; y < frame->height; y++) {
+		src = frame->data + frame->pitch * y;
+		for (x = 0; x < frame->width; x++) {
+			row[x * 3] = src[x * 4 + 2];
+			row[x * 3 + 1] = src[x * 4 + 1];
+			row[x * 3 + 2] = src[x * 4];
+		}
+		fwrite(row, 3, frame->width, f);
+	}
+
+	fclose(f);
+	lv_free(row);
+}
+
+/*
+ * Hand the written frames to the callback or into PPM files, oldest first.
+ * Waits up to timeout ms for each frame still being written.
+ */
+static void drm_capture_poll(struct drm_output *out, int timeout)
+{
+	struct drm_capture *cap = &out->capture;
+	drm_capture_frame_t frame;
+	struct pollfd pfd;
+	int i, idx;
+
+	for (;;) {
+		idx = -1;
+		for (i = 0; i < DRM_CAPTURE_BUFFERS; i++) {
+			if (cap->fence[i] >= 0 && (idx < 0 || cap->frame[i] < cap->frame[idx]))
+				idx = i;
+		}
+		if (idx < 0)
+			return;
+
+		pfd.fd = cap->fence[idx];
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, timeout) <= 0)
+			return;
+
+		close(cap->fence[idx]);
+		cap->fence[idx] = -1;
+
+		frame.frame = cap->frame[idx];
+		frame.width = out->mode.hdisplay;
+		frame.height = out->mode.vdisplay;
+		frame.pitch = cap->bufs[idx].pitch;
+		frame.data = cap->bufs[idx].map;
+		if (cap->cb)
+			cap->cb(out, &frame, cap->user_data);
+		else
+			drm_capture_write_ppm(cap->path, &frame);
+	}
+}
+
+static void drm_capture_free_bufs(struct drm_output *out)
+{
+	struct drm_capture *cap = &out->capture;
+	int i;
+
+	for (i = 0; i < DRM_CAPTURE_BUFFERS; i++) {
+		/* The kernel keeps a buffer which is still written */
+		if (cap->fence[i] >= 0)
+			close(cap->fence[i]);
+		cap->fence[i] = -1;
+		drm_free_dumb(&cap->bufs[i]);
+	}
+}
+
+/*
+ * Writeback buffers of the size of the mode, after the pending frames are
+ * delivered.
+ */
+static int drm_capture_alloc_bufs(struct drm_output *out)
+{
+	struct drm_capture *cap = &out->capture;
+	int i;
+
+	drm_capture_poll(out, 100);
+	drm_capture_free_bufs(out);
+
+	for (i = 0; i < DRM_CAPTURE_BUFFERS; i++) {
+		if (drm_allocate_dumb(&cap->bufs[i], out->mode.hdisplay, out->mode.vdisplay, 32,
+				      DRM_FORMAT_XRGB8888)) {
+			drm_capture_free_bufs(out);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void drm_capture_free(struct drm_output *out)
+{
+	struct drm_capture *cap = &out->capture;
+
+	cap->active = false;
+	if (cap->bufs[0].handle || cap->bufs[0].fb_handle)
+		drm_capture_free_bufs(out);
+	lv_free(cap->path);
+	cap->path = NULL;
+}
+
+int drm_output_start_capture(drm_output_t *out, uint32_t interval, drm_capture_cb_t cb, const char *path,
+			     void *user_data)
+{
+	struct drm_capture *cap = &out->capture;
+	uint32_t conn_id;
+	int i;
+
+	if (!cb && !path) {
+		err("Capture needs a callback or a file name");
+		return -1;
+	}
+
+	if (cap->active)
+		drm_output_stop_capture(out);
+
+	if (!cap->obj.id) {
+		/* Writeback connectors are listed only for clients asking for them */
+		if (drmSetClientCap(drm_dev.fd, DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, 1)) {
+			err("No writeback connector support: %s", strerror(errno));
+			return -1;
+		}
+
+		conn_id = drm_find_writeback(out);
+		if (!conn_id) {
+			err("No writeback connector for connector %u", out->conn_id);
+			return -1;
+		}
+
+		if (drm_object_init(&cap->obj, conn_id, DRM_MODE_OBJECT_CONNECTOR)) {
+			err("Cannot get writeback connector props");
+			return -1;
+		}
+
+		for (i = 0; i < DRM_CAPTURE_BUFFERS; i++)
+			cap->fence[i] = -1;
+	}
+
+	if (path) {
+		cap->path = lv_malloc(strlen(path) + 1);
+		if (!cap->path)
+			return -1;
+		strcpy(cap->path, path);
+	}
+
+	if (drm_capture_alloc_bufs(out)) {
+		err("Cannot allocate the writeback buffers");
+		drm_capture_free(out);
+		return -1;
+	}
+
+	cap->interval = interval;
+	cap->next = false;
+	cap->cb = cb;
+	cap->user_data = user_data;
+	cap->active = true;
+
+	info("drm: capturing connector %u with writeback connector %u", out->conn_id, cap->obj.id);
+
+	return 0;
+}
+
+void drm_output_capture_next(drm_output_t *out)
+{
+	out->capture.next = true;
+}
+
+void drm_output_stop_capture(drm_output_t *out)
+{
+	if (!out->capture.active)
+		return;
+
+	drm_capture_poll(out, 100);
+	drm_capture_free(out);
+}
+#endif
+
+uint64_t drm_output_get_next_vblank(drm_output_t *out)
+{
+	uint64_t now;
+
+	if (!drm_dev.monotonic || !out->vblank_ns)
+		return 0;
+
+	now = drm_time_ns();
+	if (now <= out->vblank_ns)
+		return out->vblank_ns + out->period_ns;
+
+	return out->vblank_ns + ((now - out->vblank_ns) / out->period_ns + 1) * out->period_ns;
+}
+
+uint32_t drm_output_get_sleep_us(drm_output_t *out)
+{
+	uint64_t now = drm_time_ns();
+	uint64_t vblank = drm_output_get_next_vblank(out);
+	uint64_t start;
+
+	if (!vblank)
+		return 0;
+
+	/* With a flip pending the next frame can't be shown before the vblank after it */
+	if (out->flip_pending)
+		vblank += out->period_ns;
+
+	/* Start as late as possible to show the newest input. If that vblank can't
+	 * be made anymore, starting right away wouldn't show the frame any earlier. */
+	start = vblank - out->render_ns - DRM_VBLANK_MARGIN_US * 1000ULL;
+	while (start < now)
+		start += out->period_ns;
+
+	out->render_start = start;
+	return (start - now) / 1000;
+}
+
+uint32_t drm_get_sleep_us(void)
+{
+	uint32_t sleep = UINT32_MAX;
+	uint32_t i;
+
+	for (i = 0; i < drm_dev.output_cnt; i++)
+		sleep = LV_MIN(sleep, drm_output_get_sleep_us(&drm_dev.outputs[i]));
+
+	return drm_dev.output_cnt ? sleep : 0;
+}
+
+#if DRM_FLIP_STATS
+void drm_output_get_flip_stats(drm_output_t *out, drm_flip_stats_t *stats)
+{
+	*stats = out->stats;
+}
+
+void drm_output_reset_flip_stats(drm_output_t *out)
+{
+	lv_memset(&out->stats, 0, sizeof(out->stats));
+#if DRM_FLIP_LOG > 0
+	out->log_cnt = 0;
+#endif
+}
+
+uint32_t drm_flip_stats_percentile(const drm_flip_stats_t *stats, uint32_t percent)
+{
+	uint64_t target, sum = 0;
+	uint32_t i;
+
+	if (stats->frame_cnt == 0)
+		return 0;
+	if (percent > 100)
+		percent = 100;
+
+	target = DIV_ROUND_UP((uint64_t)stats->frame_cnt * percent, 100);
+	for (i = 0; i < 31; i++) {
+		sum += stats->hist[i];
+		if (sum >= target && sum > 0)
+			break;
+	}
+
+	return i < 31 ? (2U << i) - 1 : UINT32_MAX;
+}
+
+#if DRM_FLIP_LOG > 0
+uint32_t drm_output_get_flip_log(drm_output_t *out, drm_flip_record_t *recs, uint32_t max)
+{
+	uint32_t cnt = LV_MIN(LV_MIN(out->log_cnt, (uint32_t)DRM_FLIP_LOG), max);
+	uint32_t i;
+
+	for (i = 0; i < cnt; i++)
+		recs[i] = out->log[(out->log_cnt - cnt + i) % DRM_FLIP_LOG];
+
+	return cnt;
+}
+
+void drm_output_dump_flip_log(drm_output_t *out)
+{
+	uint32_t cnt = LV_MIN(out->log_cnt, (uint32_t)DRM_FLIP_LOG);
+	uint32_t i;
+
+	info("drm: connector %u, last %u frames (us): frame, wait, flush->commit, commit, commit->flip, vblanks",
+	     out->conn_id, cnt);
+	for (i = 0; i < cnt; i++) {
+		const drm_flip_record_t *rec = &out->log[(out->log_cnt - cnt + i) % DRM_FLIP_LOG];
+		info("%u %u %u %u %u %u", rec->frame, rec->wait_ns / 1000,
+		     (uint32_t)((rec->commit_ns - rec->flush_ns) / 1000), rec->commit_dur_ns / 1000,
+		     (uint32_t)((rec->flip_ns - rec->commit_ns) / 1000), rec->vblank_delta);
+	}
+}
+#endif
+#endif
+
+void drm_output_get_sizes(drm_output_t *out, lv_coord_t *width, lv_coord_t *height, uint32_t *dpi)
+{
+	if (width)
+		*width = out->width;
+
+	if (height)
+		*height = out->height;
+
+	if (dpi && out->mmWidth)
+		*dpi = DIV_ROUND_UP(out->width * 25400, out->mmWidth * 1000);
+}
+
+void drm_get_sizes(lv_coord_t *width, lv_coord_t *height, uint32_t *dpi)
+{
+	drm_output_get_sizes(&drm_dev.outputs[0], width, height, dpi);
+}
+
+#if DRM_HOTPLUG
+static int drm_uevent_open(void)
+{
+	struct sockaddr_nl addr;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -1;
+
+	lv_memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1; /* Kernel uevents */
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Read the queued uevents, true if one is a change of our card. The kernel
+ * sends them with HOTPLUG=1 when connectors change, udevadm trigger too.
+ */
+static bool drm_uevent_changed(void)
+{
+	char buf[2048];
+	char minor[32];
+	bool changed = false;
+	bool change, drm, card;
+	ssize_t len;
+	char *p;
+
+	snprintf(minor, sizeof(minor), "MINOR=%u", drm_dev.minor);
+
+	while ((len = recv(drm_dev.uevent_fd, buf, sizeof(buf) - 1, 0)) > 0) {
+		buf[len] = '\0';
+		change = drm = card = false;
+		/* "action@devpath" followed by KEY=value strings */
+		for (p = buf; p < buf + len; p += strlen(p) + 1) {
+			if (!strcmp(p, "ACTION=change"))
+				change = true;
+			else if (!strcmp(p, "SUBSYSTEM=drm"))
+				drm = true;
+			else if (!strcmp(p, minor))
+				card = true;
+		}
+		changed |= change && drm && card;
+	}
 
-			for (crtc = 0 ; crtc < res->count_crtcs; crtc++) {
-				uint32_t crtc_mask = 1 << crtc;
+	return changed;
+}
 
-				crtc_id = res->crtcs[crtc];
+static void drm_hotplug_timer_cb(lv_timer_t *timer)
+{
+	LV_UNUSED(timer);
 
-				dbg("enc_id %d crtc%d id %d mask %x possible %x", enc->encoder_id, crtc, crtc_id, crtc_mask, enc->possible_crtcs);
+	if (drm_uevent_changed())
+		drm_handle_hotplug();
+}
+#endif
 
-				if (enc->possible_crtcs & crtc_mask)
-					break;
-			}
+static int drm_init_card(uint32_t max_outputs)
+{
+	uint32_t i;
+	int ret;
 
-			if (crtc_id > 0) {
-				drm_dev.enc_id = enc->encoder_id;
-				dbg("enc_id: %d", drm_dev.enc_id);
-				drm_dev.crtc_id = crtc_id;
-				dbg("crtc_id: %d", drm_dev.crtc_id);
-				break;
-			}
+#if DRM_HOTPLUG
+	drm_dev.uevent_fd = -1;
+#endif
 
-			drmModeFreeEncoder(enc);
-			enc = NULL;
-		}
+	ret = drm_setup(max_outputs);
+	if (ret) {
+		drm_dev.fd = -1;
+		return -1;
+	}
 
-		if (!enc) {
-			err("suitable encoder not found");
-			goto free_res;
+	/* Keep the outputs whose buffers could be allocated */
+	for (i = 0; i < drm_dev.output_cnt; ) {
+		ret = drm_setup_buffers(&drm_dev.outputs[i]);
+		if (ret == 0) {
+			i++;
+			continue;
 		}
 
-		drmModeFreeEncoder(enc);
+		err("DRM buffer allocation failed for connector %u", drm_dev.outputs[i].conn_id);
+		drm_output_free(&drm_dev.outputs[i]);
+		drm_dev.outputs[i] = drm_dev.outputs[--drm_dev.output_cnt];
+		lv_memset(&drm_dev.outputs[drm_dev.output_cnt], 0, sizeof(struct drm_output));
 	}
 
-	drm_dev.crtc_idx = UINT32_MAX;
-
-	for (i = 0; i < res->count_crtcs; ++i) {
-		if (drm_dev.crtc_id == res->crtcs[i]) {
-			drm_dev.crtc_idx = i;
-			break;
-		}
+	if (!drm_dev.output_cnt) {
+		close(drm_dev.fd);
+		drm_dev.fd = -1;
+		return -1;
 	}
 
-	if (drm_dev.crtc_idx == UINT32_MAX) {
-		err("drm: CRTC not found");
-		goto free_res;
+#if DRM_HOTPLUG
+	drm_dev.uevent_fd = drm_uevent_open();
+	if (drm_dev.uevent_fd < 0) {
+		info("drm: cannot open the uevent socket, no hotplug: %s", strerror(errno));
+	} else {
+		drm_dev.hotplug_timer = lv_timer_create(drm_hotplug_timer_cb, 100, NULL);
 	}
+#endif
 
-	dbg("crtc_idx: %d", drm_dev.crtc_idx);
-
+	info("DRM subsystem and buffer mapped successfully");
 	return 0;
-
-free_res:
-	drmModeFreeResources(res);
-
-	return -1;
 }
 
-static int drm_open(const char *path)
+int drm_init(void)
 {
-	int fd, flags;
-	uint64_t has_dumb;
-	int ret;
+	return drm_init_card(1);
+}
 
-	fd = open(path, O_RDWR);
-	if (fd < 0) {
-		err("cannot open \"%s\"", path);
+int drm_init_outputs(void)
+{
+	if (drm_init_card(DRM_MAX_OUTPUTS))
 		return -1;
-	}
 
-	/* set FD_CLOEXEC flag */
-	if ((flags = fcntl(fd, F_GETFD)) < 0 ||
-	     fcntl(fd, F_SETFD, flags | FD_CLOEXEC) < 0) {
-		err("fcntl FD_CLOEXEC failed");
-		goto err;
-	}
+	return drm_dev.output_cnt;
+}
 
-	/* check capability */
-	ret = drmGetCap(fd, DRM_CAP_DUMB_BUFFER, &has_dumb);
-	if (ret < 0 || has_dumb == 0) {
-		err("drmGetCap DRM_CAP_DUMB_BUFFER failed or \"%s\" doesn't have dumb "
-		    "buffer", path);
-		goto err;
-	}
+uint32_t drm_get_output_count(void)
+{
+	return drm_dev.output_cnt;
+}
 
-	return fd;
-err:
-	close(fd);
-	return -1;
+drm_output_t * drm_get_output(uint32_t idx)
+{
+	return idx < drm_dev.output_cnt ? &drm_dev.outputs[idx] : NULL;
 }
 
-static int drm_setup(unsigned int fourcc)
+uint32_t drm_output_get_connector_id(drm_output_t *out)
 {
-	int ret;
-	const char *device_path = NULL;
+	return out->conn_id;
+}
 
-	device_path = getenv("DRM_CARD");
-	if (!device_path)
-		device_path = DRM_CARD;
+int drm_output_disp_drv_init(drm_output_t *out, lv_disp_drv_t * disp_drv)
+{
+#if DRM_SHADOW_BUFFER
+	/* Render into cached memory, drm_flush() copies the damage into the dumb buffers */
+	if (!out->shadow)
+		out->shadow = lv_malloc(out->width * out->height * (LV_COLOR_SIZE / 8));
+	if (!out->shadow && !out->px_conv)
+		err("Cannot allocate the shadow buffer, rendering into the dumb buffers");
+#endif
 
-	drm_dev.fd = drm_open(device_path);
-	if (drm_dev.fd < 0)
+	/* LVGL can't render into buffers of another format, drm_flush() converts */
+	if (out->px_conv && !out->shadow)
+		out->shadow = lv_malloc(out->width * out->height * (LV_COLOR_SIZE / 8));
+	if (out->px_conv && !out->shadow) {
+		err("Cannot allocate the shadow buffer for the pixel conversion");
 		return -1;
-
-	ret = drmSetClientCap(drm_dev.fd, DRM_CLIENT_CAP_ATOMIC, 1);
-	if (ret) {
-		err("No atomic modesetting support: %s", strerror(errno));
-		goto err;
-	}
-
-	ret = drm_find_connector();
-	if (ret) {
-		err("available drm devices not found");
-		goto err;
 	}
 
-	ret = find_plane(fourcc, &drm_dev.plane_id, drm_dev.crtc_id, drm_dev.crtc_idx);
-	if (ret) {
-		err("Cannot find plane");
-		goto err;
+	if (out->shadow) {
+		lv_memset(out->shadow, 0, out->width * out->height * (LV_COLOR_SIZE / 8));
+		lv_disp_draw_buf_init(&out->draw_buf, out->shadow, NULL, out->width * out->height);
+	} else {
+		lv_disp_draw_buf_init(&out->draw_buf, out->drm_bufs[out->render_idx].map,
+				      out->drm_bufs[(out->render_idx + 1) % DRM_BUFFER_COUNT].map,
+				      out->width * out->height);
 	}
-
-	drm_dev.plane = drmModeGetPlane(drm_dev.fd, drm_dev.plane_id);
-	if (!drm_dev.plane) {
-		err("Cannot get plane");
-		goto err;
+	disp_drv->draw_buf = &out->draw_buf;
+	disp_drv->direct_mode = true;
+	/* LVGL takes the resolution before rotation */
+	if (out->rotation == LV_DISP_ROT_90 || out->rotation == LV_DISP_ROT_270) {
+		disp_drv->hor_res = out->height;
+		disp_drv->ver_res = out->width;
+	} else {
+		disp_drv->hor_res = out->width;
+		disp_drv->ver_res = out->height;
 	}
+	disp_drv->rotated = out->rotation;
+	disp_drv->sw_rotate = 0;
+	disp_drv->flush_cb = drm_flush;
+	disp_drv->wait_cb = drm_wait_vsync;
+	disp_drv->user_data = out;
+	out->drv = disp_drv;
+	return 0;
+}
 
-	drm_dev.crtc = drmModeGetCrtc(drm_dev.fd, drm_dev.crtc_id);
-	if (!drm_dev.crtc) {
-		err("Cannot get crtc");
-		goto err;
-	}
+lv_disp_t * drm_output_create_disp(drm_output_t *out)
+{
+	lv_disp_drv_init(&out->disp_drv);
 
-	drm_dev.conn = drmModeGetConnector(drm_dev.fd, drm_dev.conn_id);
-	if (!drm_dev.conn) {
-		err("Cannot get connector");
-		goto err;
-	}
+	if (drm_output_disp_drv_init(out, &out->disp_drv))
+		return NULL;
 
-	ret = drm_get_plane_props();
-	if (ret) {
-		err("Cannot get plane props");
-		goto err;
-	}
+	return lv_disp_drv_register(&out->disp_drv);
+}
 
-	ret = drm_get_crtc_props();
-	if (ret) {
-		err("Cannot get crtc props");
-		goto err;
+/*
+ * Turn the CRTC and the planes of an output off, e.g. because its monitor is
+ * gone. Frames are dropped from now on.
+ */
+static void drm_output_disable(struct drm_output *out)
+{
+	int i, ret;
+
+	out->disconnected = true;
+
+	/* A pending flip still completes, give it a few vblanks */
+	for (i = 0; out->flip_pending && i < 10; i++)
+		drm_handle_events(100);
+	out->flip_pending = false;
+
+	if (!out->modeset_done)
+		return;
+
+	drmModeAtomicSetCursor(out->req, 0);
+	drm_object_set(out->req, &out->plane_obj, DRM_PROP_FB_ID, 0);
+	drm_object_set(out->req, &out->plane_obj, DRM_PROP_CRTC_ID, 0);
+	if (out->cursor.plane_id) {
+		drm_object_set(out->req, &out->cursor.obj, DRM_PROP_FB_ID, 0);
+		drm_object_set(out->req, &out->cursor.obj, DRM_PROP_CRTC_ID, 0);
+		/* Shown again with the next frame */
+		out->cursor.dirty = true;
 	}
-
-	ret = drm_get_conn_props();
-	if (ret) {
-		err("Cannot get connector props");
-		goto err;
+#if DRM_MAX_LAYERS > 0
+	for (i = 0; i < DRM_MAX_LAYERS; i++) {
+		if (!out->layers[i].out)
+			continue;
+		drm_object_set(out->req, &out->layers[i].obj, DRM_PROP_FB_ID, 0);
+		drm_object_set(out->req, &out->layers[i].obj, DRM_PROP_CRTC_ID, 0);
 	}
+#endif
+	drm_object_set(out->req, &out->conn_obj, DRM_PROP_CRTC_ID, 0);
+#if DRM_CAPTURE
+	/* Attached again with the next frame if still capturing */
+	if (out->capture.obj.id)
+		drm_object_set(out->req, &out->capture.obj, DRM_PROP_CRTC_ID, 0);
+#endif
+	drm_object_set(out->req, &out->crtc_obj, DRM_PROP_MODE_ID, 0);
+	drm_object_set(out->req, &out->crtc_obj, DRM_PROP_ACTIVE, 0);
 
-	drm_dev.drm_event_ctx.version = DRM_EVENT_CONTEXT_VERSION;
-	drm_dev.drm_event_ctx.page_flip_handler = page_flip_handler;
-	drm_dev.fourcc = fourcc;
-
-	info("drm: Found plane_id: %u connector_id: %d crtc_id: %d",
-		drm_dev.plane_id, drm_dev.conn_id, drm_dev.crtc_id);
+	ret = drmModeAtomicCommit(drm_dev.fd, out->req, DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
 
-	info("drm: %dx%d (%dmm X% dmm) pixel format %c%c%c%c",
-	     drm_dev.width, drm_dev.height, drm_dev.mmWidth, drm_dev.mmHeight,
-	     (fourcc>>0)&0xff, (fourcc>>8)&0xff, (fourcc>>16)&0xff, (fourcc>>24)&0xff);
+	drm_output_commit_done(out, ret == 0);
 
-	return 0;
+	if (ret)
+		err("Cannot disable connector %u: %s", out->conn_id, strerror(errno));
 
-err:
-	close(drm_dev.fd);
-	return -1;
+	/* The next frame sets the mode again */
+	out->modeset_done = false;
+	for (i = 0; i < DRM_BUFFER_COUNT; i++) {
+		if (out->drm_bufs[i].state != DRM_BUF_RENDERING)
+			out->drm_bufs[i].state = DRM_BUF_FREE;
+	}
+#if DRM_MAX_LAYERS > 0
+	drm_layers_reset(out);
+#endif
 }
 
-static int drm_allocate_dumb(struct drm_buffer *buf)
+/*
+ * Switch a disabled output to a new mode: new blob and buffers of the new size.
+ * The old ones are freed only once the new ones are set up, on failure LVGL
+ * keeps drawing into them and the output stays as it was.
+ */
+static int drm_output_set_mode(struct drm_output *out, const drmModeModeInfo *mode)
 {
-	struct drm_mode_create_dumb creq;
-	struct drm_mode_map_dumb mreq;
-	uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
+	struct drm_output *old;
+	uint32_t blob_id;
 	int ret;
 
-	/* create dumb buffer */
-	lv_memset(&creq, 0, sizeof(creq));
-	creq.width = drm_dev.width;
-	creq.height = drm_dev.height;
-	creq.bpp = LV_COLOR_DEPTH;
-	ret = drmIoctl(drm_dev.fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq);
-	if (ret < 0) {
-		err("DRM_IOCTL_MODE_CREATE_DUMB fail");
+	if (drmModeCreatePropertyBlob(drm_dev.fd, mode, sizeof(*mode), &blob_id)) {
+		err("error creating mode blob");
 		return -1;
 	}
 
-	buf->handle = creq.handle;
-	buf->pitch = creq.pitch;
-	buf->size = creq.size;
-
-	/* prepare buffer for memory mapping */
-	lv_memset(&mreq, 0, sizeof(mreq));
-	mreq.handle = creq.handle;
-	ret = drmIoctl(drm_dev.fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq);
-	if (ret) {
-		err("DRM_IOCTL_MODE_MAP_DUMB fail");
+	old = lv_malloc(sizeof(*old));
+	if (!old) {
+		err("Cannot allocate memory for the mode switch");
+		drmModeDestroyPropertyBlob(drm_dev.fd, blob_id);
 		return -1;
 	}
+	lv_memcpy(old, out, sizeof(*old));
+
+	/* The old buffers live on in `old` */
+	lv_memset(out->drm_bufs, 0, sizeof(out->drm_bufs));
+	out->shadow = NULL;
+	out->map_col = NULL;
+	out->map_row = NULL;
+	out->map_line = NULL;
+	out->conv_line = NULL;
+	out->sw_transform = false;
+	out->blob_id = blob_id;
+
+	lv_memset(&out->dmg_cache, 0, sizeof(out->dmg_cache));
+#if DRM_DAMAGE_CLIPS > 0
+	out->damage_cnt = 0;
+#endif
+	out->vblank_ns = 0;
+	out->render_start = 0;
 
-	buf->offset = mreq.offset;
-	info("size %lu pitch %u offset %u", buf->size, buf->pitch, buf->offset);
+	drm_output_use_mode(out, mode);
 
-	/* perform actual memory mapping */
-	buf->map = mmap(0, creq.size, PROT_READ | PROT_WRITE, MAP_SHARED, drm_dev.fd, mreq.offset);
-	if (buf->map == MAP_FAILED) {
-		err("mmap fail");
-		return -1;
+	ret = drm_setup_buffers(out);
+	if (ret) {
+		drm_output_free_buffers(out);
+		drmModeDestroyPropertyBlob(drm_dev.fd, blob_id);
+		lv_memcpy(out, old, sizeof(*out));
+		lv_free(old);
+		return ret;
 	}
 
-	/* clear the framebuffer to 0 (= full transparency in ARGB8888) */
-	lv_memset(buf->map, 0, creq.size);
+	drm_output_free_buffers(old);
+	if (old->blob_id)
+		drmModeDestroyPropertyBlob(drm_dev.fd, old->blob_id);
+	lv_free(old);
 
-	/* create framebuffer object for the dumb-buffer */
-	handles[0] = creq.handle;
-	pitches[0] = creq.pitch;
-	offsets[0] = 0;
-	ret = drmModeAddFB2(drm_dev.fd, drm_dev.width, drm_dev.height, drm_dev.fourcc,
-			    handles, pitches, offsets, &buf->fb_handle, 0);
-	if (ret) {
-		err("drmModeAddFB fail");
-		return -1;
+#if DRM_CAPTURE
+	/* Writeback buffers have the size of the mode */
+	if (out->capture.active && drm_capture_alloc_bufs(out)) {
+		err("Cannot allocate the writeback buffers, capture stopped");
+		drm_capture_free(out);
 	}
+#endif
 
 	return 0;
 }
 
-static int drm_setup_buffers(void)
+/*
+ * Hand the new buffers and resolution to LVGL, it redraws everything.
+ */
+static void drm_output_update_disp(struct drm_output *out)
 {
-	int ret;
+	lv_disp_t *disp = NULL;
 
-	/*Allocate DUMB buffers*/
-	ret = drm_allocate_dumb(&drm_dev.drm_bufs[0]);
-	if (ret)
-		return ret;
+	if (!out->drv)
+		return;
 
-	ret = drm_allocate_dumb(&drm_dev.drm_bufs[1]);
-	if (ret)
-		return ret;
+	while ((disp = lv_disp_get_next(disp)) && disp->driver != out->drv)
+		;
 
-	return 0;
+	drm_output_disp_drv_init(out, out->drv);
+	if (disp)
+		lv_disp_drv_update(disp, out->drv);
 }
 
-void drm_wait_vsync(lv_disp_drv_t * disp_drv)
+int drm_handle_hotplug(void)
 {
-	while(drm_dev.req) {
-		struct pollfd pfd;
-		pfd.fd = drm_dev.fd;
-		pfd.events = POLLIN;
-
-		int ret;
-		do {
-			ret = poll(&pfd, 1, -1);
-		} while (ret == -1 && errno == EINTR);
-
-		if(ret > 0)
-			drmHandleEvent(drm_dev.fd, &drm_dev.drm_event_ctx);
-		else {
-			err("poll failed: %s", strerror(errno));
-			return;
-		}
-	}
-
-	lv_disp_flush_ready(disp_drv);
-}
+	drmModeConnector *conn;
+	struct drm_output *out;
+	bool connected;
+	uint32_t i;
+	int changed = 0;
 
-void drm_flush(lv_disp_drv_t * disp_drv, const lv_area_t * area, lv_color_t * color_p)
-{
-	struct drm_buffer *fbuf = &drm_dev.drm_bufs[drm_dev.active_drm_buf_idx ^ 1];
+	for (i = 0; i < drm_dev.output_cnt; i++) {
+		out = &drm_dev.outputs[i];
 
-	if(!disp_drv->direct_mode) {
-		/*Backwards compatibility: Non-direct flush */
-		uint32_t w = (area->x2 - area->x1) + 1;
-		for (int y = 0, i = area->y1; i <= area->y2 ; ++i, ++y) {
-			lv_memcpy(fbuf->map + (area->x1 * (LV_COLOR_SIZE / 8)) + (fbuf->pitch * i),
-			          (uint8_t *)color_p + (w * (LV_COLOR_SIZE / 8) * y),
-			          w * (LV_COLOR_SIZE / 8));
-		}
-	}
+		conn = drmModeGetConnector(drm_dev.fd, out->conn_id);
+		if (!conn)
+			continue;
 
-	if(lv_disp_flush_is_last(disp_drv)) {
-		/*Request buffer swap*/
-		if(drm_dmabuf_set_plane(fbuf)) {
-			err("Flush fail");
-			return;
+		connected = conn->connection == DRM_MODE_CONNECTED && conn->count_modes > 0;
+		if (!connected) {
+			if (!out->disconnected) {
+				info("drm: connector %u disconnected", out->conn_id);
+				drm_output_disable(out);
+				changed++;
+			}
+		} else if (out->disconnected || memcmp(&conn->modes[0], &out->mode, sizeof(out->mode))) {
+			info("drm: connector %u connected, %ux%u@%u", out->conn_id,
+			     conn->modes[0].hdisplay, conn->modes[0].vdisplay, conn->modes[0].vrefresh);
+			drm_output_disable(out);
+			if (drm_output_set_mode(out, &conn->modes[0]) == 0) {
+				out->disconnected = false;
+				drm_output_update_disp(out);
+			} else {
+				/* LVGL keeps the old buffers, frames are dropped until the next uevent */
+				err("Cannot set up connector %u for the new mode", out->conn_id);
+			}
+			changed++;
 		}
-		else
-			dbg("Flush done");
 
-		drm_dev.active_drm_buf_idx ^= 1;
+		out->mmWidth = conn->mmWidth;
+		out->mmHeight = conn->mmHeight;
+		drmModeFreeConnector(out->conn);
+		out->conn = conn;
 	}
-}
-
-#if LV_COLOR_DEPTH == 32
-#define DRM_FOURCC DRM_FORMAT_XRGB8888
-#elif LV_COLOR_DEPTH == 16
-#define DRM_FOURCC DRM_FORMAT_RGB565
-#else
-#error LV_COLOR_DEPTH not supported
-#endif
 
-void drm_get_sizes(lv_coord_t *width, lv_coord_t *height, uint32_t *dpi)
-{
-	if (width)
-		*width = drm_dev.width;
-
-	if (height)
-		*height = drm_dev.height;
-
-	if (dpi && drm_dev.mmWidth)
-		*dpi = DIV_ROUND_UP(drm_dev.width * 25400, drm_dev.mmWidth * 1000);
+	return changed;
 }
 
-int drm_init(void)
+bool drm_output_is_connected(drm_output_t *out)
 {
-	int ret;
-
-	ret = drm_setup(DRM_FOURCC);
-	if (ret) {
-		close(drm_dev.fd);
-		drm_dev.fd = -1;
-		return -1;
-	}
-
-	ret = drm_setup_buffers();
-	if (ret) {
-		err("DRM buffer allocation failed");
-		close(drm_dev.fd);
-		drm_dev.fd = -1;
-		return -1;
-	}
-
-	info("DRM subsystem and buffer mapped successfully");
-	return 0;
+	return !out->disconnected;
 }
 
 int drm_disp_drv_init(lv_disp_drv_t * disp_drv)
@@ -788,18 +3872,26 @@ int drm_disp_drv_init(lv_disp_drv_t * disp_drv)
 	int ret = drm_init();
 	if(ret) return ret;
 
-	lv_disp_draw_buf_init(&drm_dev.draw_buf, drm_dev.drm_bufs[1].map, drm_dev.drm_bufs[0].map, drm_dev.width * drm_dev.height);
-	disp_drv->draw_buf = &drm_dev.draw_buf;
-	disp_drv->direct_mode = true;
-	disp_drv->hor_res = drm_dev.width;
-	disp_drv->ver_res = drm_dev.height;
-	disp_drv->flush_cb = drm_flush;
-	disp_drv->wait_cb = drm_wait_vsync;
-	return 0;
+	return drm_output_disp_drv_init(&drm_dev.outputs[0], disp_drv);
 }
 
 void drm_exit(void)
 {
+	uint32_t i;
+
+#if DRM_HOTPLUG
+	if (drm_dev.hotplug_timer)
+		lv_timer_del(drm_dev.hotplug_timer);
+	drm_dev.hotplug_timer = NULL;
+	if (drm_dev.uevent_fd >= 0)
+		close(drm_dev.uevent_fd);
+	drm_dev.uevent_fd = -1;
+#endif
+
+	for (i = 0; i < drm_dev.output_cnt; i++)
+		drm_output_free(&drm_dev.outputs[i]);
+	drm_dev.output_cnt = 0;
+
 	close(drm_dev.fd);
 	drm_dev.fd = -1;
 }
@@ -33,10 +33,73 @@ extern "C" {
  *      DEFINES
  *********************/
 
+/*Measure the latency from the first flush of a frame to its flip*/
+#ifndef DRM_FLIP_STATS
+#define DRM_FLIP_STATS 0
+#endif
+
+/*Number of shown frames DRM_FLIP_STATS keeps the timestamps of*/
+#ifndef DRM_FLIP_LOG
+#define DRM_FLIP_LOG 64
+#endif
+
+/*Capture the frames the CRTC scans out with a writeback connector*/
+#ifndef DRM_CAPTURE
+#define DRM_CAPTURE 0
+#endif
+
+/*Displays on overlay planes an output can have besides its own*/
+#ifndef DRM_MAX_LAYERS
+#define DRM_MAX_LAYERS 2
+#endif
+
 /**********************
  *      TYPEDEFS
  **********************/
 
+/*A connector with its own CRTC, plane and buffers*/
+typedef struct drm_output drm_output_t;
+
+/*Timestamps of one shown frame, CLOCK_MONOTONIC in ns*/
+typedef struct {
+    uint32_t frame;         /*Number of the frame*/
+    uint32_t vblank_delta;  /*Vblanks since the previous flip, more than 1: a frame was shown again*/
+    uint64_t flush_ns;      /*First flush of the frame*/
+    uint64_t commit_ns;     /*Atomic commit of the frame*/
+    uint64_t flip_ns;       /*Flip, the vblank the frame is shown from*/
+    uint32_t commit_dur_ns; /*Time spent in the commit ioctl*/
+    uint32_t wait_ns;       /*Time blocked in `drm_wait_vsync()` for its buffer*/
+} drm_flip_record_t;
+
+/*Statistics of the shown frames*/
+typedef struct {
+    uint32_t frame_cnt;     /*Number of shown frames*/
+    uint32_t dropped_cnt;   /*Frames replaced by a newer one before their commit*/
+    uint32_t failed_cnt;    /*Failed commits*/
+    uint32_t late_cnt;      /*Frames not shown at the first vblank after their commit*/
+    uint32_t missed_vblanks;/*Vblanks these frames missed*/
+    uint64_t commit_ns;     /*Total time spent in the commit ioctl*/
+    uint32_t max_commit_ns;
+    uint64_t wait_ns;       /*Total time blocked in `drm_wait_vsync()`*/
+    uint32_t max_wait_ns;
+    uint64_t latency_ns;    /*Total time from the first flush to the flip*/
+    uint32_t max_latency_ns;
+    uint32_t hist[32];      /*Number of frames shown 2^i ... 2^(i+1) - 1 ns after their first flush*/
+} drm_flip_stats_t;
+
+#if DRM_CAPTURE
+/*A frame written back by the display engine, valid only during the callback*/
+typedef struct {
+    uint32_t frame;         /*Number of the frame*/
+    uint32_t width;
+    uint32_t height;
+    uint32_t pitch;         /*Bytes per row*/
+    const uint8_t * data;   /*XRGB8888*/
+} drm_capture_frame_t;
+
+typedef void (*drm_capture_cb_t)(drm_output_t * out, const drm_capture_frame_t * frame, void * user_data);
+#endif
+
 /**********************
  * GLOBAL PROTOTYPES
  **********************/
@@ -48,6 +111,66 @@ void drm_exit(void);
 void drm_flush(lv_disp_drv_t * drv, const lv_area_t * area, lv_color_t * color_p);
 void drm_wait_vsync(lv_disp_drv_t * drv);
 
+/*Drive every connected connector (up to DRM_MAX_OUTPUTS), returns the number of outputs or -1*/
+int drm_init_outputs(void);
+uint32_t drm_get_output_count(void);
+drm_output_t * drm_get_output(uint32_t idx);
+uint32_t drm_output_get_connector_id(drm_output_t * out);
+void drm_output_get_sizes(drm_output_t * out, lv_coord_t * width, lv_coord_t * height, uint32_t * dpi);
+int drm_output_disp_drv_init(drm_output_t * out, lv_disp_drv_t * disp_drv);
+lv_disp_t * drm_output_create_disp(drm_output_t * out);
+
+/*Re-probe the connectors: outputs whose monitor is gone are turned off, new modes get new buffers
+ *and `lv_disp_drv_update()`. Called on DRM uevents with DRM_HOTPLUG (off by default), otherwise the
+ *application can call it, returns the number of changed outputs*/
+int drm_handle_hotplug(void);
+bool drm_output_is_connected(drm_output_t * out);
+
+/*Show the pointer on the cursor plane instead of an LVGL object, img NULL hides it*/
+int drm_output_set_cursor(drm_output_t * out, const lv_img_dsc_t * img, lv_coord_t hot_x, lv_coord_t hot_y);
+void drm_output_move_cursor(drm_output_t * out, lv_coord_t x, lv_coord_t y);
+
+/*CLOCK_MONOTONIC time of the next vblank in ns, 0 if not known yet*/
+uint64_t drm_output_get_next_vblank(drm_output_t * out);
+/*Time to sleep before `lv_timer_handler()` so the frame is ready just before a vblank*/
+uint32_t drm_output_get_sleep_us(drm_output_t * out);
+uint32_t drm_get_sleep_us(void); /*The shortest one of all outputs*/
+
+#if DRM_FLIP_STATS
+/*Statistics since the start or the last reset, cheap enough to keep enabled*/
+void drm_output_get_flip_stats(drm_output_t * out, drm_flip_stats_t * stats);
+void drm_output_reset_flip_stats(drm_output_t * out);
+/*Upper bound of a percentile (0 ... 100) of the latencies in ns, 0 if no frame was shown*/
+uint32_t drm_flip_stats_percentile(const drm_flip_stats_t * stats, uint32_t percent);
+#if DRM_FLIP_LOG > 0
+/*Copy the last (up to `max`) shown frames, oldest first, returns their number*/
+uint32_t drm_output_get_flip_log(drm_output_t * out, drm_flip_record_t * recs, uint32_t max);
+void drm_output_dump_flip_log(drm_output_t * out); /*Print the kept frames to stderr*/
+#endif
+#endif
+
+#if DRM_MAX_LAYERS > 0
+/*Create a display of `w` x `h` CRTC pixels (not scaled or rotated) shown at `x`, `y` on an overlay plane.
+ *Planes with a higher `zpos` are shown on top, the primary plane usually has 0. Its frames go into the
+ *commits of the output, so e.g. an animated gauge is updated without touching the background's buffers*/
+lv_disp_t * drm_output_create_layer(drm_output_t * out, lv_coord_t x, lv_coord_t y, lv_coord_t w, lv_coord_t h,
+                                    uint32_t zpos);
+/*Move or hide a display created by `drm_output_create_layer()`, returns -1 if the plane can't show it there*/
+int drm_layer_set_pos(lv_disp_t * disp, lv_coord_t x, lv_coord_t y);
+void drm_layer_set_visible(lv_disp_t * disp, bool visible);
+#endif
+
+#if DRM_CAPTURE
+/*Let the display engine write every `interval`-th frame (0: only the ones asked for with
+ *`drm_output_capture_next()`) into a buffer of a writeback connector, e.g. the one of vkms.
+ *The frames go to `cb`, or with `cb` NULL into PPM files named by `path`, a printf format of the frame number*/
+int drm_output_start_capture(drm_output_t * out, uint32_t interval, drm_capture_cb_t cb, const char * path,
+                             void * user_data);
+void drm_output_capture_next(drm_output_t * out);
+/*Deliver the frames still being written, the connector is detached with the next frame*/
+void drm_output_stop_capture(drm_output_t * out);
+#endif
+
 /**********************
  *      MACROS
  **********************/
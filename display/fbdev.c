@@ -6,6 +6,9 @@
 /*********************
  *      INCLUDES
  *********************/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /*For pthread_setaffinity_np*/
+#endif
 #include "fbdev.h"
 #if USE_FBDEV || USE_BSD_FBDEV
 
@@ -16,14 +19,26 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <errno.h>
+#include <time.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FBDEV_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define FBDEV_SSE2 1
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#define FBDEV_SSSE3_DISPATCH 1
+#endif
+#endif
 
 #if USE_BSD_FBDEV
 #include <sys/fcntl.h>
 #include <sys/time.h>
 #include <sys/consio.h>
 #include <sys/fbio.h>
-#else  /* USE_BSD_FBDEV */
-#include <linux/fb.h>
 #endif /* USE_BSD_FBDEV */
 
 /*********************
@@ -33,6 +48,13 @@
 #define FBDEV_PATH  "/dev/fb0"
 #endif
 
+/*Size of the tiles transposed for 90 and 270 degrees rotation*/
+#define FBDEV_ROT_TILE 16
+
+/*Pixels converted into a cached buffer at once before streaming them into the framebuffer.
+ *A multiple of 64, so that the chunks of a row end on whole 64 byte lines at any depth.*/
+#define FBDEV_STREAM_CHUNK_PX 256
+
 #ifndef DIV_ROUND_UP
 #define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
 #endif
@@ -41,40 +63,54 @@
  *      TYPEDEFS
  **********************/
 
-/**********************
- *      STRUCTURES
- **********************/
-
-struct bsd_fb_var_info{
-    uint32_t xoffset;
-    uint32_t yoffset;
-    uint32_t xres;
-    uint32_t yres;
-    int bits_per_pixel;
- };
-
-struct bsd_fb_fix_info{
-    long int line_length;
-    long int smem_len;
-};
-
 /**********************
  *  STATIC PROTOTYPES
  **********************/
+static void fbdev_device_close(fbdev_device_t * dsc);
+static bool fbdev_device_map(fbdev_device_t * dsc);
+static void fbdev_pages_init(fbdev_device_t * dsc);
+static void fbdev_page_sync(fbdev_device_t * dsc, uint32_t dst_page);
+static void fbdev_page_add_dmg(fbdev_device_t * dsc, uint32_t page, const lv_area_t * area);
+static void fbdev_page_flip(fbdev_device_t * dsc, lv_disp_drv_t * drv, uint32_t page);
+static void fbdev_wait_for_vsync(fbdev_device_t * dsc);
+static bool fbdev_vsync_since_pan(fbdev_device_t * dsc);
+static void fbdev_vsync_flush_ready(fbdev_device_t * dsc, lv_disp_drv_t * drv);
+static void fbdev_flush_area(fbdev_device_t * dsc, lv_disp_drv_t * drv, const lv_area_t * area, lv_color_t * color_p);
+static void fbdev_copy_rows(fbdev_device_t * dsc, const fbdev_copy_job_t * job, int32_t y1, int32_t y2);
+static void fbdev_copy_rows_rotated(fbdev_device_t * dsc, const fbdev_copy_job_t * job, int32_t y1, int32_t y2);
+static void fbdev_write_row(fbdev_device_t * dsc, int32_t x, int32_t y, uint32_t yoffset, const lv_color_t * src,
+                            uint32_t px_cnt);
+static void fbdev_rotate_area(fbdev_device_t * dsc, lv_disp_rot_t rot, lv_area_t * area);
+static uint64_t fbdev_time_ns(void);
+#if FBDEV_FLUSH_STATS
+static void fbdev_stats_add(fbdev_device_t * dsc, uint32_t px_cnt, uint64_t ns);
+#endif
+#if FBDEV_COPY_THREADS > 0
+static void fbdev_stripes_start(fbdev_device_t * dsc);
+static void fbdev_stripes_stop(fbdev_device_t * dsc);
+static void fbdev_stripes_run(fbdev_device_t * dsc, const fbdev_copy_job_t * job);
+static void fbdev_stripe_copy(fbdev_device_t * dsc, uint32_t idx);
+static void * fbdev_stripes_worker(void * arg);
+#endif
+#if FBDEV_ASYNC_FLUSH
+static bool fbdev_async_start(fbdev_device_t * dsc);
+static void fbdev_async_stop(fbdev_device_t * dsc);
+static void fbdev_async_wait(fbdev_device_t * dsc);
+static void * fbdev_async_worker(void * arg);
+#endif
+static fbdev_px_conv_t fbdev_select_px_conv(uint32_t bits_per_pixel, fbdev_copy_mode_t mode);
+static void fb_copy(fbdev_device_t * dsc, uint8_t * dst, const uint8_t * src, size_t len);
+static void fb_stream_copy(uint8_t * dst, const uint8_t * src, size_t len);
+static void fb_stream_conv(fbdev_device_t * dsc, uint8_t * dst, const lv_color_t * src, uint32_t px_cnt);
+static void fb_stream_fence(void);
+static void px_transpose(lv_color_t * dst, uint32_t dst_stride, const lv_color_t * src, int32_t src_stride,
+                         uint32_t w, uint32_t h);
+static void px_pack_1bpp(uint8_t * dst, uint32_t x, const lv_color_t * src, uint32_t px_cnt);
 
 /**********************
  *  STATIC VARIABLES
  **********************/
-#if USE_BSD_FBDEV
-static struct bsd_fb_var_info vinfo;
-static struct bsd_fb_fix_info finfo;
-#else
-static struct fb_var_screeninfo vinfo;
-static struct fb_fix_screeninfo finfo;
-#endif /* USE_BSD_FBDEV */
-static char *fbp = 0;
-static long int screensize = 0;
-static int fbfd = 0;
+static fbdev_device_t global_dsc = {.fd = -1};
 
 /**********************
  *      MACROS
@@ -90,16 +126,36 @@ static int fbfd = 0;
 
 void fbdev_init(void)
 {
+    /*Close the device and free the draw buffers of a previous call*/
+    fbdev_device_exit(&global_dsc);
+    fbdev_device_init(&global_dsc);
+    fbdev_device_set_file(&global_dsc, FBDEV_PATH);
+}
+
+void fbdev_device_init(fbdev_device_t * dsc)
+{
+    lv_memset(dsc, 0, sizeof(fbdev_device_t));
+    dsc->fd = -1;
+    dsc->page_cnt = 1;
+    dsc->copy_mode = FBDEV_STREAM_COPY ? FBDEV_COPY_STREAM : FBDEV_COPY_MEMCPY;
+}
+
+bool fbdev_device_set_file(fbdev_device_t * dsc, const char * dev_path)
+{
+    fbdev_device_close(dsc);
+
+    if(!dev_path) return false;
+
     // Open the file for reading and writing
-    fbfd = open(FBDEV_PATH, O_RDWR);
-    if(fbfd == -1) {
+    dsc->fd = open(dev_path, O_RDWR);
+    if(dsc->fd == -1) {
         perror("Error: cannot open framebuffer device");
-        return;
+        return false;
     }
     LV_LOG_INFO("The framebuffer device was opened successfully");
 
     // Make sure that the display is on.
-    if (ioctl(fbfd, FBIOBLANK, FB_BLANK_UNBLANK) != 0) {
+    if (ioctl(dsc->fd, FBIOBLANK, FB_BLANK_UNBLANK) != 0) {
         perror("ioctl(FBIOBLANK)");
         // Don't return. Some framebuffer drivers like efifb or simplefb don't implement FBIOBLANK.
     }
@@ -109,49 +165,342 @@ void fbdev_init(void)
     unsigned line_length;
 
     //Get fb type
-    if (ioctl(fbfd, FBIOGTYPE, &fb) != 0) {
+    if (ioctl(dsc->fd, FBIOGTYPE, &fb) != 0) {
         perror("ioctl(FBIOGTYPE)");
-        return;
+        return false;
     }
 
     //Get screen width
-    if (ioctl(fbfd, FBIO_GETLINEWIDTH, &line_length) != 0) {
+    if (ioctl(dsc->fd, FBIO_GETLINEWIDTH, &line_length) != 0) {
         perror("ioctl(FBIO_GETLINEWIDTH)");
-        return;
+        return false;
     }
 
-    vinfo.xres = (unsigned) fb.fb_width;
-    vinfo.yres = (unsigned) fb.fb_height;
-    vinfo.bits_per_pixel = fb.fb_depth;
-    vinfo.xoffset = 0;
-    vinfo.yoffset = 0;
-    finfo.line_length = line_length;
-    finfo.smem_len = finfo.line_length * vinfo.yres;
+    dsc->vinfo.xres = (unsigned) fb.fb_width;
+    dsc->vinfo.yres = (unsigned) fb.fb_height;
+    dsc->vinfo.bits_per_pixel = fb.fb_depth;
+    dsc->vinfo.xoffset = 0;
+    dsc->vinfo.yoffset = 0;
+    dsc->finfo.line_length = line_length;
+    dsc->finfo.smem_len = dsc->finfo.line_length * dsc->vinfo.yres;
 #else /* USE_BSD_FBDEV */
 
     // Get fixed screen information
-    if(ioctl(fbfd, FBIOGET_FSCREENINFO, &finfo) == -1) {
+    if(ioctl(dsc->fd, FBIOGET_FSCREENINFO, &dsc->finfo) == -1) {
         perror("Error reading fixed information");
-        return;
+        return false;
     }
 
     // Get variable screen information
-    if(ioctl(fbfd, FBIOGET_VSCREENINFO, &vinfo) == -1) {
+    if(ioctl(dsc->fd, FBIOGET_VSCREENINFO, &dsc->vinfo) == -1) {
         perror("Error reading variable information");
-        return;
+        return false;
     }
 #endif /* USE_BSD_FBDEV */
 
-    LV_LOG_INFO("%dx%d, %dbpp", vinfo.xres, vinfo.yres, vinfo.bits_per_pixel);
+    return fbdev_device_map(dsc);
+}
+
+bool fbdev_device_set_fake_file(fbdev_device_t * dsc, int fd, uint32_t xres, uint32_t yres, uint32_t bpp,
+                                uint32_t line_length)
+{
+    fbdev_device_close(dsc);
+
+    if(line_length == 0) line_length = DIV_ROUND_UP(xres * bpp, 8);
+
+    lv_memset(&dsc->vinfo, 0, sizeof(dsc->vinfo));
+    lv_memset(&dsc->finfo, 0, sizeof(dsc->finfo));
+    dsc->vinfo.xres = xres;
+    dsc->vinfo.yres = yres;
+    dsc->vinfo.bits_per_pixel = bpp;
+    dsc->finfo.line_length = line_length;
+    dsc->finfo.smem_len = line_length * yres * FBDEV_BUFFER_COUNT;
+
+    dsc->fd = fd;
+    dsc->fake = true;
+    dsc->vsync_unsupported = true;
+
+    if(ftruncate(fd, dsc->finfo.smem_len) == -1) {
+        perror("Error: cannot resize the fake framebuffer");
+        return false;
+    }
+
+    return fbdev_device_map(dsc);
+}
+
+void fbdev_exit(void)
+{
+    fbdev_device_exit(&global_dsc);
+}
+
+void fbdev_device_exit(fbdev_device_t * dsc)
+{
+    fbdev_device_set_file(dsc, NULL);
+
+    lv_free(dsc->bufs[0]);
+    lv_free(dsc->bufs[1]);
+    dsc->bufs[0] = NULL;
+    dsc->bufs[1] = NULL;
+}
+
+void fbdev_flush(lv_disp_drv_t * drv, const lv_area_t * area, lv_color_t * color_p)
+{
+    fbdev_device_t * dsc = drv->user_data ? drv->user_data : &global_dsc;
+
+#if FBDEV_ASYNC_FLUSH
+    /*Let the flush thread copy, meanwhile LVGL can render into its other draw buffer*/
+    if(dsc->async.running && !drv->direct_mode) {
+        pthread_mutex_lock(&dsc->async.lock);
+        dsc->async.drv = drv;
+        dsc->async.area = *area;
+        dsc->async.color_p = color_p;
+        dsc->async.pending = true;
+        pthread_cond_broadcast(&dsc->async.cond);
+        pthread_mutex_unlock(&dsc->async.lock);
+        return;
+    }
+#endif
+
+    fbdev_flush_area(dsc, drv, area, color_p);
+}
+
+void fbdev_wait_vsync(lv_disp_drv_t * drv)
+{
+    fbdev_device_t * dsc = drv->user_data ? drv->user_data : &global_dsc;
+
+#if FBDEV_ASYNC_FLUSH
+    /*The flush thread reports the flush ready itself, also after waiting for the vertical sync*/
+    fbdev_async_wait(dsc);
+    if(!drv->draw_buf->flushing) return;
+#endif
+
+    fbdev_vsync_flush_ready(dsc, drv);
+}
+
+void fbdev_get_sizes(uint32_t *width, uint32_t *height, uint32_t *dpi) {
+    fbdev_device_get_sizes(&global_dsc, width, height, dpi);
+}
+
+void fbdev_device_get_sizes(fbdev_device_t * dsc, uint32_t * width, uint32_t * height, uint32_t * dpi)
+{
+    if (width)
+        *width = dsc->vinfo.xres;
+
+    if (height)
+        *height = dsc->vinfo.yres;
+
+    if (dpi && dsc->vinfo.height)
+        *dpi = DIV_ROUND_UP(dsc->vinfo.xres * 254, dsc->vinfo.width * 10);
+}
+
+void fbdev_set_offset(uint32_t xoffset, uint32_t yoffset) {
+    fbdev_device_set_offset(&global_dsc, xoffset, yoffset);
+}
+
+void fbdev_device_set_offset(fbdev_device_t * dsc, uint32_t xoffset, uint32_t yoffset)
+{
+    dsc->vinfo.xoffset = xoffset;
+    dsc->vinfo.yoffset = yoffset;
+}
+
+void fbdev_set_copy_mode(fbdev_copy_mode_t mode)
+{
+    fbdev_device_set_copy_mode(&global_dsc, mode);
+}
+
+void fbdev_device_set_copy_mode(fbdev_device_t * dsc, fbdev_copy_mode_t mode)
+{
+    dsc->copy_mode = mode;
+    if(dsc->fd >= 0) dsc->px_conv = fbdev_select_px_conv(dsc->vinfo.bits_per_pixel, mode);
+}
+
+#if FBDEV_FLUSH_STATS
+void fbdev_device_get_flush_stats(fbdev_device_t * dsc, fbdev_flush_stats_t * stats)
+{
+    *stats = dsc->stats;
+}
+
+void fbdev_device_reset_flush_stats(fbdev_device_t * dsc)
+{
+    lv_memset(&dsc->stats, 0, sizeof(dsc->stats));
+}
+
+uint32_t fbdev_flush_stats_percentile(const fbdev_flush_stats_t * stats, uint32_t percent)
+{
+    if(stats->flush_cnt == 0) return 0;
+    if(percent > 100) percent = 100;
+
+    uint64_t target = DIV_ROUND_UP((uint64_t)stats->flush_cnt * percent, 100);
+    uint64_t sum = 0;
+    uint32_t i;
+    for(i = 0; i < 31; i++) {
+        sum += stats->hist[i];
+        if(sum >= target && sum > 0) break;
+    }
+
+    return i < 31 ? (2U << i) - 1 : UINT32_MAX;
+}
+#endif
+
+#if FBDEV_COPY_THREADS > 0
+bool fbdev_device_set_copy_thread_cpu(fbdev_device_t * dsc, uint32_t idx, int cpu)
+{
+#ifdef __linux__
+    if(idx >= dsc->stripes.thread_cnt) return false;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    int ret = pthread_setaffinity_np(dsc->stripes.threads[idx], sizeof(set), &set);
+    if(ret != 0) {
+        errno = ret;
+        perror("pthread_setaffinity_np");
+        return false;
+    }
+    return true;
+#else
+    LV_UNUSED(dsc);
+    LV_UNUSED(idx);
+    LV_UNUSED(cpu);
+    return false;
+#endif
+}
+#endif
+
+uint32_t fbdev_get_buffer_count(void)
+{
+    return fbdev_device_get_buffer_count(&global_dsc);
+}
+
+uint32_t fbdev_device_get_buffer_count(fbdev_device_t * dsc)
+{
+    return dsc->page_cnt;
+}
+
+int fbdev_disp_drv_init(lv_disp_drv_t * disp_drv)
+{
+    fbdev_init();
+
+    return fbdev_device_disp_drv_init(&global_dsc, disp_drv);
+}
+
+int fbdev_device_disp_drv_init(fbdev_device_t * dsc, lv_disp_drv_t * disp_drv)
+{
+    lv_disp_drv_init(disp_drv);
+
+    if(dsc->fbp == NULL) return -1;
+
+    uint32_t px_size = LV_COLOR_SIZE / 8;
+    uint32_t page_size = dsc->finfo.line_length * dsc->vinfo.yres;
+
+    disp_drv->hor_res = dsc->vinfo.xres;
+    disp_drv->ver_res = dsc->vinfo.yres;
+    disp_drv->flush_cb = fbdev_flush;
+    disp_drv->wait_cb = fbdev_wait_vsync;
+    disp_drv->user_data = dsc;
+
+#if FBDEV_ROTATION == 90
+    disp_drv->rotated = LV_DISP_ROT_90;
+#elif FBDEV_ROTATION == 180
+    disp_drv->rotated = LV_DISP_ROT_180;
+#elif FBDEV_ROTATION == 270
+    disp_drv->rotated = LV_DISP_ROT_270;
+#endif
+
+    /*LVGL can draw directly into the framebuffer only if the pixel format and the stride match
+     *and the driver doesn't have to rotate*/
+    if(FBDEV_ROTATION == 0 &&
+       dsc->vinfo.bits_per_pixel == LV_COLOR_DEPTH && LV_COLOR_DEPTH >= 8 &&
+       dsc->vinfo.xoffset == 0 && dsc->finfo.line_length == dsc->vinfo.xres * px_size) {
+        /*LVGL alternates between at most two buffers in direct mode*/
+        if(dsc->page_cnt > 2) dsc->page_cnt = 2;
+
+        if(dsc->page_cnt > 1) {
+            /*Start drawing into the page which isn't visible*/
+            lv_disp_draw_buf_init(&dsc->draw_buf, dsc->fbp + dsc->back_page * page_size,
+                                  dsc->fbp + ((dsc->back_page + 1) % dsc->page_cnt) * page_size,
+                                  dsc->vinfo.xres * dsc->vinfo.yres);
+        }
+        else {
+            lv_disp_draw_buf_init(&dsc->draw_buf, dsc->fbp + dsc->vinfo.yoffset * dsc->finfo.line_length, NULL,
+                                  dsc->vinfo.xres * dsc->vinfo.yres);
+        }
+        disp_drv->direct_mode = true;
+        LV_LOG_INFO("Drawing directly into the framebuffer");
+    }
+    else {
+        uint32_t buf_size = dsc->vinfo.xres * DIV_ROUND_UP(dsc->vinfo.yres, 10);
+        if(dsc->bufs[0] == NULL) dsc->bufs[0] = lv_malloc(buf_size * sizeof(lv_color_t));
+        if(dsc->bufs[1] == NULL) dsc->bufs[1] = lv_malloc(buf_size * sizeof(lv_color_t));
+        if(dsc->bufs[0] == NULL || dsc->bufs[1] == NULL) {
+            LV_LOG_ERROR("Failed to allocate the draw buffers");
+            return -1;
+        }
+        lv_disp_draw_buf_init(&dsc->draw_buf, dsc->bufs[0], dsc->bufs[1], buf_size);
+    }
+
+    disp_drv->draw_buf = &dsc->draw_buf;
+    return 0;
+}
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+
+/**
+ * Stop the threads, unmap and close the file of a device.
+ * @param dsc framebuffer device
+ */
+static void fbdev_device_close(fbdev_device_t * dsc)
+{
+#if FBDEV_ASYNC_FLUSH
+    fbdev_async_stop(dsc);
+#endif
+#if FBDEV_COPY_THREADS > 0
+    fbdev_stripes_stop(dsc);
+#endif
+
+    /*Unmap and close previous device*/
+    if(dsc->fbp) {
+        munmap(dsc->fbp, dsc->screensize);
+        dsc->fbp = NULL;
+    }
+    if(dsc->fd != -1) {
+        close(dsc->fd);
+        dsc->fd = -1;
+    }
+    dsc->px_conv = NULL;
+    dsc->page_cnt = 1;
+    dsc->fake = false;
+    dsc->vsync_unsupported = false;
+}
+
+/**
+ * Set up the pages and the pixel conversion of an opened device, map it and start the threads.
+ * @param dsc framebuffer device
+ * @return whether the device was mapped
+ */
+static bool fbdev_device_map(fbdev_device_t * dsc)
+{
+    fbdev_pages_init(dsc);
+
+    dsc->px_conv = fbdev_select_px_conv(dsc->vinfo.bits_per_pixel, dsc->copy_mode);
+    if(dsc->px_conv == NULL && dsc->vinfo.bits_per_pixel != 1) {
+        LV_LOG_WARN("%dbpp framebuffers are not supported", dsc->vinfo.bits_per_pixel);
+    }
+
+    LV_LOG_INFO("%dx%d, %dbpp, %d page(s)", dsc->vinfo.xres, dsc->vinfo.yres, dsc->vinfo.bits_per_pixel, dsc->page_cnt);
 
     // Figure out the size of the screen in bytes
-    screensize =  finfo.smem_len; //finfo.line_length * vinfo.yres;    
+    dsc->screensize =  dsc->finfo.smem_len; //finfo.line_length * vinfo.yres;
 
     // Map the device to memory
-    fbp = (char *)mmap(0, screensize, PROT_READ | PROT_WRITE, MAP_SHARED, fbfd, 0);
-    if((intptr_t)fbp == -1) {
+    dsc->fbp = (char *)mmap(0, dsc->screensize, PROT_READ | PROT_WRITE, MAP_SHARED, dsc->fd, 0);
+    if((intptr_t)dsc->fbp == -1) {
         perror("Error: failed to map framebuffer device to memory");
-        return;
+        dsc->fbp = NULL;
+        return false;
     }
 
     // Don't initialise the memory to retain what's currently displayed / avoid clearing the screen.
@@ -159,134 +508,1357 @@ void fbdev_init(void)
 
     LV_LOG_INFO("The framebuffer device was mapped to memory successfully");
 
+#if FBDEV_COPY_THREADS > 0
+    fbdev_stripes_start(dsc);
+#endif
+
+#if FBDEV_ASYNC_FLUSH
+    if(!fbdev_async_start(dsc)) {
+        LV_LOG_WARN("Failed to start the flush thread, flushing synchronously");
+    }
+#endif
+
+    return true;
 }
 
-void fbdev_exit(void)
+/**
+ * Copy or convert some rows of an area to the framebuffer.
+ * @param dsc framebuffer device
+ * @param job the area to copy
+ * @param y1 first row to copy, between `job->y1` and `job->y2`
+ * @param y2 last row to copy, between `job->y1` and `job->y2`
+ */
+static void fbdev_copy_rows(fbdev_device_t * dsc, const fbdev_copy_job_t * job, int32_t y1, int32_t y2)
+{
+    if(job->rot != LV_DISP_ROT_NONE) {
+        fbdev_copy_rows_rotated(dsc, job, y1, y2);
+    }
+    else {
+        const lv_color_t * color_p = job->color_p + (y1 - job->y1) * job->src_w;
+        int32_t y;
+        for(y = y1; y <= y2; y++) {
+            fbdev_write_row(dsc, job->x1, y, job->yoffset, color_p, job->w);
+            color_p += job->src_w;
+        }
+    }
+
+    /*Make the streamed pixels visible before the flush is reported ready*/
+    if(dsc->copy_mode == FBDEV_COPY_STREAM) fb_stream_fence();
+}
+
+/**
+ * Copy or convert some rows of an area to the framebuffer and rotate them.
+ * 90 and 270 degrees are transposed in tiles, which are written in short physical rows,
+ * so neither the source nor the framebuffer is walked column by column.
+ * @param dsc framebuffer device
+ * @param job the area to copy, in rotated coordinates
+ * @param y1 first row to copy, between `job->y1` and `job->y2`
+ * @param y2 last row to copy, between `job->y1` and `job->y2`
+ */
+static void fbdev_copy_rows_rotated(fbdev_device_t * dsc, const fbdev_copy_job_t * job, int32_t y1, int32_t y2)
+{
+    lv_color_t tile[FBDEV_ROT_TILE * FBDEV_ROT_TILE];
+    int32_t xres = dsc->vinfo.xres;
+    int32_t yres = dsc->vinfo.yres;
+    int32_t x2 = job->x1 + job->w - 1;
+    int32_t tx;
+    int32_t ty;
+
+    if(job->rot == LV_DISP_ROT_180) {
+        /*Mirror the rows in chunks, the last chunk goes to the start of the physical row*/
+        for(ty = y1; ty <= y2; ty++) {
+            const lv_color_t * src = job->color_p + (ty - job->y1) * job->src_w;
+            for(tx = job->x1; tx <= x2; tx += FBDEV_ROT_TILE * FBDEV_ROT_TILE) {
+                int32_t n = LV_MIN(FBDEV_ROT_TILE * FBDEV_ROT_TILE, x2 - tx + 1);
+                int32_t i;
+                for(i = 0; i < n; i++) tile[i] = src[tx - job->x1 + n - 1 - i];
+                fbdev_write_row(dsc, xres - 1 - (tx + n - 1), yres - 1 - ty, job->yoffset, tile, n);
+            }
+        }
+        return;
+    }
+
+    for(ty = y1; ty <= y2; ty += FBDEV_ROT_TILE) {
+        int32_t th = LV_MIN(FBDEV_ROT_TILE, y2 - ty + 1);
+        for(tx = job->x1; tx <= x2; tx += FBDEV_ROT_TILE) {
+            int32_t tw = LV_MIN(FBDEV_ROT_TILE, x2 - tx + 1);
+            const lv_color_t * src = job->color_p + (ty - job->y1) * job->src_w + (tx - job->x1);
+            int32_t j;
+
+            if(job->rot == LV_DISP_ROT_90) {
+                /*A column of the tile becomes a physical row, from the bottom of the screen up*/
+                px_transpose(tile, th, src, job->src_w, tw, th);
+                for(j = 0; j < tw; j++) {
+                    fbdev_write_row(dsc, ty, yres - 1 - (tx + j), job->yoffset, &tile[j * th], th);
+                }
+            }
+            else {
+                /*Transpose from the last row up, so that the physical rows go right to left*/
+                px_transpose(tile, th, src + (th - 1) * job->src_w, -job->src_w, tw, th);
+                for(j = 0; j < tw; j++) {
+                    fbdev_write_row(dsc, xres - 1 - (ty + th - 1), tx + j, job->yoffset, &tile[j * th], th);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Copy or convert pixels into a row of the framebuffer.
+ * @param dsc framebuffer device
+ * @param x first column to write
+ * @param y row to write
+ * @param yoffset first row of the page to write into
+ * @param src pixels to write
+ * @param px_cnt number of pixels to write
+ */
+static void fbdev_write_row(fbdev_device_t * dsc, int32_t x, int32_t y, uint32_t yoffset, const lv_color_t * src,
+                            uint32_t px_cnt)
+{
+    uint8_t * fbp8 = (uint8_t *)dsc->fbp;
+    long int location = 0;
+
+    /*8, 16, 24 and 32 bit per pixel*/
+    if(dsc->px_conv) {
+        location = (x + dsc->vinfo.xoffset) * (dsc->vinfo.bits_per_pixel / 8) + (y + yoffset) * dsc->finfo.line_length;
+        /*Plain copies are streamed by `px_copy_stream`, conversions through a cached buffer*/
+        if(dsc->copy_mode == FBDEV_COPY_STREAM && dsc->vinfo.bits_per_pixel != LV_COLOR_DEPTH) {
+            fb_stream_conv(dsc, &fbp8[location], src, px_cnt);
+        }
+        else {
+            dsc->px_conv(&fbp8[location], src, px_cnt);
+        }
+    }
+    /*1 bit per pixel*/
+    else if(dsc->vinfo.bits_per_pixel == 1) {
+        location = (y + yoffset) * dsc->finfo.line_length;
+        px_pack_1bpp(&fbp8[location], x + dsc->vinfo.xoffset, src, px_cnt);
+    } else {
+        /*Not supported bit per pixel*/
+    }
+}
+
+static uint64_t fbdev_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#if FBDEV_FLUSH_STATS
+
+/**
+ * Add a flush to the statistics.
+ * @param dsc framebuffer device
+ * @param px_cnt number of pixels written
+ * @param ns time spent copying
+ */
+static void fbdev_stats_add(fbdev_device_t * dsc, uint32_t px_cnt, uint64_t ns)
+{
+    fbdev_flush_stats_t * stats = &dsc->stats;
+    uint32_t ns32 = ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns;
+    uint32_t bucket = 0;
+
+    while(bucket < 31 && (ns32 >> (bucket + 1)) != 0) bucket++;
+
+    stats->flush_cnt++;
+    stats->px_cnt += px_cnt;
+    stats->byte_cnt += DIV_ROUND_UP((uint64_t)px_cnt * dsc->vinfo.bits_per_pixel, 8);
+    stats->time_ns += ns;
+    if(ns32 > stats->max_ns) stats->max_ns = ns32;
+    stats->hist[bucket]++;
+}
+#endif
+
+/**
+ * Convert an area from LVGL's rotated coordinates to framebuffer coordinates.
+ * @param dsc framebuffer device
+ * @param rot rotation of the display
+ * @param area the area to convert
+ */
+static void fbdev_rotate_area(fbdev_device_t * dsc, lv_disp_rot_t rot, lv_area_t * area)
 {
-    close(fbfd);
+    lv_coord_t xres = dsc->vinfo.xres;
+    lv_coord_t yres = dsc->vinfo.yres;
+    lv_area_t a = *area;
+
+    switch(rot) {
+        case LV_DISP_ROT_90:
+            area->x1 = a.y1;
+            area->x2 = a.y2;
+            area->y1 = yres - 1 - a.x2;
+            area->y2 = yres - 1 - a.x1;
+            break;
+        case LV_DISP_ROT_180:
+            area->x1 = xres - 1 - a.x2;
+            area->x2 = xres - 1 - a.x1;
+            area->y1 = yres - 1 - a.y2;
+            area->y2 = yres - 1 - a.y1;
+            break;
+        case LV_DISP_ROT_270:
+            area->x1 = xres - 1 - a.y2;
+            area->x2 = xres - 1 - a.y1;
+            area->y1 = a.x1;
+            area->y2 = a.x2;
+            break;
+        default:
+            break;
+    }
 }
 
 /**
- * Flush a buffer to the marked area
- * @param drv pointer to driver where this function belongs
+ * Copy an area to the framebuffer and report the flush ready, or flip the pages after the last area.
+ * @param dsc framebuffer device
+ * @param drv pointer to the display driver
  * @param area an area where to copy `color_p`
  * @param color_p an array of pixels to copy to the `area` part of the screen
  */
-void fbdev_flush(lv_disp_drv_t * drv, const lv_area_t * area, lv_color_t * color_p)
+static void fbdev_flush_area(fbdev_device_t * dsc, lv_disp_drv_t * drv, const lv_area_t * area, lv_color_t * color_p)
 {
-    if(fbp == NULL ||
+    /*In direct mode LVGL has already drawn into the framebuffer*/
+    if(drv->direct_mode) {
+        if(dsc->page_cnt > 1 && lv_disp_flush_is_last(drv)) {
+            fbdev_page_flip(dsc, drv, ((uint8_t *)color_p - (uint8_t *)dsc->fbp) / (dsc->finfo.line_length * dsc->vinfo.yres));
+        }
+        else {
+            lv_disp_flush_ready(drv);
+        }
+        return;
+    }
+
+    /*With `sw_rotate` LVGL has rotated the area already*/
+    lv_disp_rot_t rot = drv->sw_rotate ? LV_DISP_ROT_NONE : drv->rotated;
+    bool swap_xy = rot == LV_DISP_ROT_90 || rot == LV_DISP_ROT_270;
+    int32_t hor_res = swap_xy ? dsc->vinfo.yres : dsc->vinfo.xres;
+    int32_t ver_res = swap_xy ? dsc->vinfo.xres : dsc->vinfo.yres;
+
+    if(dsc->fbp == NULL ||
             area->x2 < 0 ||
             area->y2 < 0 ||
-            area->x1 > (int32_t)vinfo.xres - 1 ||
-            area->y1 > (int32_t)vinfo.yres - 1) {
-        lv_disp_flush_ready(drv);
+            area->x1 > hor_res - 1 ||
+            area->y1 > ver_res - 1) {
+        if(dsc->page_cnt > 1 && lv_disp_flush_is_last(drv)) fbdev_page_flip(dsc, drv, dsc->back_page);
+        else lv_disp_flush_ready(drv);
         return;
     }
 
     /*Truncate the area to the screen*/
     int32_t act_x1 = area->x1 < 0 ? 0 : area->x1;
     int32_t act_y1 = area->y1 < 0 ? 0 : area->y1;
-    int32_t act_x2 = area->x2 > (int32_t)vinfo.xres - 1 ? (int32_t)vinfo.xres - 1 : area->x2;
-    int32_t act_y2 = area->y2 > (int32_t)vinfo.yres - 1 ? (int32_t)vinfo.yres - 1 : area->y2;
+    int32_t act_x2 = area->x2 > hor_res - 1 ? hor_res - 1 : area->x2;
+    int32_t act_y2 = area->y2 > ver_res - 1 ? ver_res - 1 : area->y2;
 
 
     lv_coord_t w = (act_x2 - act_x1 + 1);
-    long int location = 0;
-    long int byte_location = 0;
-    unsigned char bit_location = 0;
+    lv_coord_t src_w = lv_area_get_width(area);
 
-    /*32 bit per pixel*/
-    if(vinfo.bits_per_pixel == 32) {
-        uint32_t * fbp32 = (uint32_t *)fbp;
-        int32_t y;
-        for(y = act_y1; y <= act_y2; y++) {
-            location = (act_x1 + vinfo.xoffset) + (y + vinfo.yoffset) * finfo.line_length / 4;
-            memcpy(&fbp32[location], (uint32_t *)color_p, (act_x2 - act_x1 + 1) * 4);
-            color_p += w;
-        }
-    }
-    /*24 bit per pixel*/
-    else if(vinfo.bits_per_pixel == 24 && LV_COLOR_DEPTH == 32) {
-        uint8_t * fbp8 = (uint8_t *)fbp;
-        lv_coord_t x;
-        int32_t y;
-        uint8_t *pixel;
-        for(y = act_y1; y <= act_y2; y++) {
-            location = (act_x1 + vinfo.xoffset) + (y + vinfo.yoffset) * finfo.line_length / 3;
-            for (x = 0; x < w; ++x) {
-                pixel = (uint8_t *)(&color_p[x]);
-                fbp8[3 * (location + x)] = pixel[0];
-                fbp8[3 * (location + x) + 1] = pixel[1];
-                fbp8[3 * (location + x) + 2] = pixel[2];
-            }
-            color_p += w;
+    /*Skip the truncated part of the source*/
+    color_p += (act_y1 - area->y1) * src_w + (act_x1 - area->x1);
+
+#if FBDEV_FLUSH_STATS
+    uint64_t t_start = fbdev_time_ns();
+#endif
+
+    /*With page flipping draw into the back page instead of the scanned out one*/
+    uint32_t yoffset = dsc->vinfo.yoffset;
+    if(dsc->page_cnt > 1) {
+        if(!dsc->frame_started) {
+            fbdev_page_sync(dsc, dsc->back_page);
+            dsc->frame_started = true;
         }
+
+        lv_area_t act_area = {act_x1, act_y1, act_x2, act_y2};
+        fbdev_rotate_area(dsc, rot, &act_area);
+        fbdev_page_add_dmg(dsc, dsc->back_page, &act_area);
+        yoffset = dsc->back_page * dsc->vinfo.yres;
     }
-    /*16 bit per pixel*/
-    else if(vinfo.bits_per_pixel == 16) {
-        uint16_t * fbp16 = (uint16_t *)fbp;
-        int32_t y;
-        for(y = act_y1; y <= act_y2; y++) {
-            location = (act_x1 + vinfo.xoffset) + (y + vinfo.yoffset) * finfo.line_length / 2;
-            memcpy(&fbp16[location], (uint32_t *)color_p, (act_x2 - act_x1 + 1) * 2);
-            color_p += w;
-        }
+
+    fbdev_copy_job_t job;
+    job.x1 = act_x1;
+    job.y1 = act_y1;
+    job.y2 = act_y2;
+    job.w = w;
+    job.src_w = src_w;
+    job.yoffset = yoffset;
+    job.color_p = color_p;
+    job.rot = rot;
+
+#if FBDEV_COPY_THREADS > 0
+    /*Split large areas into stripes for the copy threads.
+     *Rotated by 90 or 270 degrees the stripes are columns, which would share bytes with less than 8bpp.*/
+    if(dsc->stripes.thread_cnt > 0 && (uint32_t)w * (act_y2 - act_y1 + 1) >= FBDEV_COPY_THREAD_MIN_PX &&
+       !(swap_xy && dsc->vinfo.bits_per_pixel < 8)) {
+        fbdev_stripes_run(dsc, &job);
     }
-    /*8 bit per pixel*/
-    else if(vinfo.bits_per_pixel == 8) {
-        uint8_t * fbp8 = (uint8_t *)fbp;
-        int32_t y;
-        for(y = act_y1; y <= act_y2; y++) {
-            location = (act_x1 + vinfo.xoffset) + (y + vinfo.yoffset) * finfo.line_length;
-            memcpy(&fbp8[location], (uint32_t *)color_p, (act_x2 - act_x1 + 1));
-            color_p += w;
-        }
+    else {
+        fbdev_copy_rows(dsc, &job, act_y1, act_y2);
     }
-    /*1 bit per pixel*/
-    else if(vinfo.bits_per_pixel == 1) {
-        uint8_t * fbp8 = (uint8_t *)fbp;
-        int32_t x;
-        int32_t y;
-        for(y = act_y1; y <= act_y2; y++) {
-            for(x = act_x1; x <= act_x2; x++) {
-                location = (x + vinfo.xoffset) + (y + vinfo.yoffset) * vinfo.xres;
-                byte_location = location / 8; /* find the byte we need to change */
-                bit_location = location % 8; /* inside the byte found, find the bit we need to change */
-                fbp8[byte_location] &= ~(((uint8_t)(1)) << bit_location);
-                fbp8[byte_location] |= ((uint8_t)(color_p->full)) << bit_location;
-                color_p++;
-            }
+#else
+    fbdev_copy_rows(dsc, &job, act_y1, act_y2);
+#endif
 
-            color_p += area->x2 - act_x2;
-        }
-    } else {
-        /*Not supported bit per pixel*/
-    }
+#if FBDEV_FLUSH_STATS
+    fbdev_stats_add(dsc, (uint32_t)w * (act_y2 - act_y1 + 1), fbdev_time_ns() - t_start);
+#endif
 
     //May be some direct update command is required
     //ret = ioctl(state->fd, FBIO_UPDATE, (unsigned long)((uintptr_t)rect));
 
+    if(dsc->page_cnt > 1 && lv_disp_flush_is_last(drv)) {
+        fbdev_page_flip(dsc, drv, dsc->back_page);
+        return;
+    }
+
     lv_disp_flush_ready(drv);
 }
 
-void fbdev_get_sizes(uint32_t *width, uint32_t *height, uint32_t *dpi) {
-    if (width)
-        *width = vinfo.xres;
+/**
+ * Grow the virtual framebuffer to FBDEV_BUFFER_COUNT pages stacked vertically.
+ * Falls back to a single page if the driver can't provide enough memory.
+ * @param dsc framebuffer device
+ */
+static void fbdev_pages_init(fbdev_device_t * dsc)
+{
+    dsc->page_cnt = 1;
+    dsc->back_page = 0;
+    dsc->pending_flips = 0;
+    dsc->frame_started = false;
+    dsc->vblank_count = false;
+    dsc->vsync_ns = 0;
+    dsc->vsync_period_ns = 0;
 
-    if (height)
-        *height = vinfo.yres;
+#if FBDEV_BUFFER_COUNT > 1
+    /*A fake framebuffer is created large enough for all pages*/
+    if(!dsc->fake) {
+#if USE_BSD_FBDEV
+        return;
+#else
+        struct fb_var_screeninfo req = dsc->vinfo;
+        req.yres_virtual = dsc->vinfo.yres * FBDEV_BUFFER_COUNT;
+        req.yoffset = 0;
+
+        if(ioctl(dsc->fd, FBIOPUT_VSCREENINFO, &req) == -1 ||
+           ioctl(dsc->fd, FBIOGET_VSCREENINFO, &req) == -1 ||
+           req.yres_virtual < dsc->vinfo.yres * FBDEV_BUFFER_COUNT) {
+            perror("Error setting the virtual resolution, page flipping is disabled");
+            return;
+        }
+
+        /*The line length and the memory size might change with the virtual resolution*/
+        if(ioctl(dsc->fd, FBIOGET_FSCREENINFO, &dsc->finfo) == -1) {
+            perror("Error reading fixed information");
+            return;
+        }
 
-    if (dpi && vinfo.height)
-        *dpi = DIV_ROUND_UP(vinfo.xres * 254, vinfo.width * 10);
+        if(dsc->finfo.smem_len < dsc->finfo.line_length * dsc->vinfo.yres * FBDEV_BUFFER_COUNT) {
+            LV_LOG_WARN("Not enough framebuffer memory for %d pages, page flipping is disabled", FBDEV_BUFFER_COUNT);
+            return;
+        }
+
+        dsc->vinfo = req;
+
+        /*Learn when a page is no longer scanned out without blocking:
+         *from the driver's vertical sync counter or the refresh period*/
+        struct fb_vblank vblank;
+        lv_memset(&vblank, 0, sizeof(vblank));
+        if(ioctl(dsc->fd, FBIOGET_VBLANK, &vblank) == 0 && (vblank.flags & FB_VBLANK_HAVE_COUNT)) {
+            dsc->vblank_count = true;
+        }
+
+        uint64_t htotal = req.xres + req.left_margin + req.right_margin + req.hsync_len;
+        uint64_t vtotal = req.yres + req.upper_margin + req.lower_margin + req.vsync_len;
+        uint64_t period_ns = htotal * vtotal * req.pixclock / 1000;
+        if(period_ns >= 1000000 && period_ns <= 1000000000) dsc->vsync_period_ns = period_ns;
+#endif
+    }
+
+    dsc->page_cnt = FBDEV_BUFFER_COUNT;
+    dsc->back_page = 1;
+
+    /*Page 0 holds what is displayed now, the other pages take it over on their first use*/
+    lv_memset(dsc->page_dmg, 0, sizeof(dsc->page_dmg));
+    dsc->page_dmg[0].full = true;
+#endif
 }
 
-void fbdev_set_offset(uint32_t xoffset, uint32_t yoffset) {
-    vinfo.xoffset = xoffset;
-    vinfo.yoffset = yoffset;
+/**
+ * Bring a page up to date with the most recently drawn page by copying the
+ * areas the other pages received since it was drawn last time.
+ * @param dsc framebuffer device
+ * @param dst_page the page to synchronize
+ */
+static void fbdev_page_sync(fbdev_device_t * dsc, uint32_t dst_page)
+{
+    uint32_t src_page = (dst_page + dsc->page_cnt - 1) % dsc->page_cnt;
+    uint8_t * fbp8 = (uint8_t *)dsc->fbp;
+    uint32_t i;
+
+    for(i = 1; i < dsc->page_cnt; i++) {
+        fbdev_page_dmg_t * dmg = &dsc->page_dmg[(dst_page + i) % dsc->page_cnt];
+        lv_area_t full_area = {0, 0, dsc->vinfo.xres - 1, dsc->vinfo.yres - 1};
+        const lv_area_t * areas = dmg->full ? &full_area : dmg->areas;
+        uint32_t cnt = dmg->full ? 1 : dmg->cnt;
+        uint32_t a;
+
+        for(a = 0; a < cnt; a++) {
+            /*Copy whole bytes, on sub-byte formats the neighbouring pixels are valid in the source too*/
+            long int start = ((areas[a].x1 + dsc->vinfo.xoffset) * dsc->vinfo.bits_per_pixel) / 8;
+            long int end = DIV_ROUND_UP((areas[a].x2 + dsc->vinfo.xoffset + 1) * dsc->vinfo.bits_per_pixel, 8);
+            lv_coord_t y;
+            for(y = areas[a].y1; y <= areas[a].y2; y++) {
+                fb_copy(dsc, (uint8_t *)&fbp8[(y + dst_page * dsc->vinfo.yres) * dsc->finfo.line_length + start],
+                        (uint8_t *)&fbp8[(y + src_page * dsc->vinfo.yres) * dsc->finfo.line_length + start],
+                        end - start);
+            }
+        }
+    }
+
+    if(dsc->copy_mode == FBDEV_COPY_STREAM) fb_stream_fence();
+
+    dsc->page_dmg[dst_page].cnt = 0;
+    dsc->page_dmg[dst_page].full = false;
 }
 
-/**********************
- *   STATIC FUNCTIONS
- **********************/
+/**
+ * Remember an area drawn into a page so that it can be replayed into the others.
+ * @param dsc framebuffer device
+ * @param page the page the area was drawn into
+ * @param area the drawn area
+ */
+static void fbdev_page_add_dmg(fbdev_device_t * dsc, uint32_t page, const lv_area_t * area)
+{
+    fbdev_page_dmg_t * dmg = &dsc->page_dmg[page];
+
+    if(dmg->full) return;
+
+    if(dmg->cnt >= FBDEV_DMG_CAPACITY) {
+        dmg->full = true;
+        return;
+    }
+
+    dmg->areas[dmg->cnt++] = *area;
+}
+
+/**
+ * Show a page and select the next one to draw into.
+ * The flush is reported ready only if a page is free for the next frame,
+ * otherwise `fbdev_wait_vsync()` reports it once the pending flips are done.
+ * @param dsc framebuffer device
+ * @param drv pointer to the display driver
+ * @param page the page to show
+ */
+static void fbdev_page_flip(fbdev_device_t * dsc, lv_disp_drv_t * drv, uint32_t page)
+{
+    /*Nothing was drawn in this frame, but the page still has to be up to date.
+     *In direct mode LVGL keeps its buffers in sync.*/
+    if(!dsc->frame_started && !drv->direct_mode) fbdev_page_sync(dsc, page);
+
+    /*The pans before a vertical sync are done, only the last of them is still scanned out*/
+    if(dsc->pending_flips > 0 && fbdev_vsync_since_pan(dsc)) dsc->pending_flips = 0;
+
+    dsc->vinfo.yoffset = page * dsc->vinfo.yres;
+#if !USE_BSD_FBDEV
+    if(!dsc->fake && ioctl(dsc->fd, FBIOPAN_DISPLAY, &dsc->vinfo) == -1) {
+        perror("ioctl(FBIOPAN_DISPLAY)");
+    }
+
+    struct fb_vblank vblank;
+    if(dsc->vblank_count && ioctl(dsc->fd, FBIOGET_VBLANK, &vblank) == 0) dsc->pan_vblank = vblank.count;
+#endif
+    dsc->pan_ns = fbdev_time_ns();
+
+    dsc->back_page = (page + 1) % dsc->page_cnt;
+    dsc->frame_started = false;
+    dsc->pending_flips++;
+
+    /*The next back page might still be scanned out until the next vertical sync*/
+    if(dsc->pending_flips < dsc->page_cnt - 1) {
+        lv_disp_flush_ready(drv);
+    }
+    else if(drv->wait_cb == NULL || FBDEV_ASYNC_FLUSH) {
+        /*Without a wait callback (or on the flush thread) wait here*/
+        fbdev_vsync_flush_ready(dsc, drv);
+    }
+}
+
+static void fbdev_vsync_flush_ready(fbdev_device_t * dsc, lv_disp_drv_t * drv)
+{
+    /*Block only if the pages are still being flipped*/
+    if(dsc->pending_flips > 0 && !fbdev_vsync_since_pan(dsc)) fbdev_wait_for_vsync(dsc);
+    dsc->pending_flips = 0;
+    lv_disp_flush_ready(drv);
+}
+
+static void fbdev_wait_for_vsync(fbdev_device_t * dsc)
+{
+#if !USE_BSD_FBDEV
+    uint32_t crtc = 0;
+
+    if(!dsc->vsync_unsupported && ioctl(dsc->fd, FBIO_WAITFORVSYNC, &crtc) == -1) {
+        /*Don't retry, most likely the driver doesn't implement it*/
+        perror("ioctl(FBIO_WAITFORVSYNC)");
+        dsc->vsync_unsupported = true;
+    }
+    else if(!dsc->vsync_unsupported && dsc->page_cnt > 1) {
+        dsc->vsync_ns = fbdev_time_ns();
+    }
+#else
+    LV_UNUSED(dsc);
+#endif
+}
+
+/**
+ * Check without blocking whether a vertical sync happened since the last pan,
+ * i.e. whether the panned page is scanned out and the pages before it are free.
+ * @param dsc framebuffer device
+ * @return true if known to have happened, false if not or unknown
+ */
+static bool fbdev_vsync_since_pan(fbdev_device_t * dsc)
+{
+#if !USE_BSD_FBDEV && FBDEV_BUFFER_COUNT > 1
+    if(dsc->vsync_unsupported) return false;
+
+    struct fb_vblank vblank;
+    if(dsc->vblank_count && ioctl(dsc->fd, FBIOGET_VBLANK, &vblank) == 0) {
+        return vblank.count != dsc->pan_vblank;
+    }
+
+    /*Extrapolate from the last vertical sync waited for. Allow for some drift
+     *of the period calculated from the timings, the anchor is renewed on every wait.*/
+    if(dsc->vsync_period_ns == 0 || dsc->vsync_ns == 0 || dsc->pan_ns < dsc->vsync_ns) return false;
+
+    uint64_t period = dsc->vsync_period_ns;
+    uint64_t next_vsync = dsc->vsync_ns + ((dsc->pan_ns - dsc->vsync_ns) / period + 1) * period;
+    return fbdev_time_ns() >= next_vsync + period / 8;
+#else
+    LV_UNUSED(dsc);
+    return false;
+#endif
+}
+
+#if FBDEV_ASYNC_FLUSH
+
+static bool fbdev_async_start(fbdev_device_t * dsc)
+{
+    if(dsc->async.running) return true;
+
+    pthread_mutex_init(&dsc->async.lock, NULL);
+    pthread_cond_init(&dsc->async.cond, NULL);
+    dsc->async.pending = false;
+    dsc->async.busy = false;
+    dsc->async.exit = false;
+
+    int ret = pthread_create(&dsc->async.thread, NULL, fbdev_async_worker, dsc);
+    if(ret != 0) {
+        errno = ret;
+        perror("pthread_create");
+        pthread_cond_destroy(&dsc->async.cond);
+        pthread_mutex_destroy(&dsc->async.lock);
+        return false;
+    }
+
+    dsc->async.running = true;
+    return true;
+}
+
+static void fbdev_async_stop(fbdev_device_t * dsc)
+{
+    if(!dsc->async.running) return;
+
+    /*Let the worker finish the pending flush first*/
+    pthread_mutex_lock(&dsc->async.lock);
+    dsc->async.exit = true;
+    pthread_cond_broadcast(&dsc->async.cond);
+    pthread_mutex_unlock(&dsc->async.lock);
+
+    pthread_join(dsc->async.thread, NULL);
+    pthread_cond_destroy(&dsc->async.cond);
+    pthread_mutex_destroy(&dsc->async.lock);
+    dsc->async.running = false;
+}
+
+/**
+ * Block until the flush thread has finished the queued flush, if any.
+ * @param dsc framebuffer device
+ */
+static void fbdev_async_wait(fbdev_device_t * dsc)
+{
+    if(!dsc->async.running) return;
+
+    pthread_mutex_lock(&dsc->async.lock);
+    while(dsc->async.pending || dsc->async.busy) {
+        pthread_cond_wait(&dsc->async.cond, &dsc->async.lock);
+    }
+    pthread_mutex_unlock(&dsc->async.lock);
+}
+
+static void * fbdev_async_worker(void * arg)
+{
+    fbdev_device_t * dsc = arg;
+
+    pthread_mutex_lock(&dsc->async.lock);
+    while(1) {
+        while(!dsc->async.pending && !dsc->async.exit) {
+            pthread_cond_wait(&dsc->async.cond, &dsc->async.lock);
+        }
+
+        if(!dsc->async.pending) break;
+
+        /*Take the flush, LVGL can queue the next one as soon as this one is reported ready*/
+        lv_disp_drv_t * drv = dsc->async.drv;
+        lv_area_t area = dsc->async.area;
+        lv_color_t * color_p = dsc->async.color_p;
+        dsc->async.pending = false;
+        dsc->async.busy = true;
+
+        /*LVGL doesn't touch the flushed buffer until the flush is reported ready*/
+        pthread_mutex_unlock(&dsc->async.lock);
+        fbdev_flush_area(dsc, drv, &area, color_p);
+        pthread_mutex_lock(&dsc->async.lock);
+
+        dsc->async.busy = false;
+        pthread_cond_broadcast(&dsc->async.cond);
+    }
+    pthread_mutex_unlock(&dsc->async.lock);
+
+    return NULL;
+}
+
+#endif /*FBDEV_ASYNC_FLUSH*/
+
+#if FBDEV_COPY_THREADS > 0
+
+/* The copy threads wait for a new `generation` of the job. The calling thread copies
+ * the first stripe itself and waits until `remaining` drops to 0.*/
+
+static void fbdev_stripes_start(fbdev_device_t * dsc)
+{
+    uint32_t i;
+
+    pthread_mutex_init(&dsc->stripes.lock, NULL);
+    pthread_cond_init(&dsc->stripes.start_cond, NULL);
+    pthread_cond_init(&dsc->stripes.done_cond, NULL);
+    dsc->stripes.generation = 0;
+    dsc->stripes.remaining = 0;
+    dsc->stripes.next_idx = 0;
+    dsc->stripes.exit = false;
+    dsc->stripes.thread_cnt = 0;
+
+    for(i = 0; i < FBDEV_COPY_THREADS; i++) {
+        int ret = pthread_create(&dsc->stripes.threads[i], NULL, fbdev_stripes_worker, dsc);
+        if(ret != 0) {
+            errno = ret;
+            perror("pthread_create");
+            break;
+        }
+        dsc->stripes.thread_cnt++;
+    }
+
+    /*`fbdev_stripes_stop()` cleans up only after started threads*/
+    if(dsc->stripes.thread_cnt == 0) {
+        pthread_cond_destroy(&dsc->stripes.done_cond);
+        pthread_cond_destroy(&dsc->stripes.start_cond);
+        pthread_mutex_destroy(&dsc->stripes.lock);
+        LV_LOG_WARN("No copy thread started, copying on the flushing thread only");
+        return;
+    }
+
+    LV_LOG_INFO("%d copy threads started", dsc->stripes.thread_cnt);
+}
+
+static void fbdev_stripes_stop(fbdev_device_t * dsc)
+{
+    uint32_t i;
+
+    if(dsc->stripes.thread_cnt == 0) return;
+
+    pthread_mutex_lock(&dsc->stripes.lock);
+    dsc->stripes.exit = true;
+    pthread_cond_broadcast(&dsc->stripes.start_cond);
+    pthread_mutex_unlock(&dsc->stripes.lock);
+
+    for(i = 0; i < dsc->stripes.thread_cnt; i++) {
+        pthread_join(dsc->stripes.threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&dsc->stripes.done_cond);
+    pthread_cond_destroy(&dsc->stripes.start_cond);
+    pthread_mutex_destroy(&dsc->stripes.lock);
+    dsc->stripes.thread_cnt = 0;
+}
+
+/**
+ * Copy an area with all copy threads and the calling thread and wait until it's done.
+ * @param dsc framebuffer device
+ * @param job the area to copy
+ */
+static void fbdev_stripes_run(fbdev_device_t * dsc, const fbdev_copy_job_t * job)
+{
+    pthread_mutex_lock(&dsc->stripes.lock);
+    dsc->stripes.job = *job;
+    dsc->stripes.remaining = dsc->stripes.thread_cnt;
+    dsc->stripes.generation++;
+    pthread_cond_broadcast(&dsc->stripes.start_cond);
+    pthread_mutex_unlock(&dsc->stripes.lock);
+
+    fbdev_stripe_copy(dsc, 0);
+
+    pthread_mutex_lock(&dsc->stripes.lock);
+    while(dsc->stripes.remaining > 0) {
+        pthread_cond_wait(&dsc->stripes.done_cond, &dsc->stripes.lock);
+    }
+    pthread_mutex_unlock(&dsc->stripes.lock);
+}
+
+/**
+ * Copy one horizontal stripe of the current job.
+ * @param dsc framebuffer device
+ * @param idx index of the stripe, 0 for the calling thread
+ */
+static void fbdev_stripe_copy(fbdev_device_t * dsc, uint32_t idx)
+{
+    const fbdev_copy_job_t * job = &dsc->stripes.job;
+    uint32_t stripe_cnt = dsc->stripes.thread_cnt + 1;
+    int32_t rows = job->y2 - job->y1 + 1;
+    int32_t y1 = job->y1 + (int32_t)((int64_t)rows * idx / stripe_cnt);
+    int32_t y2 = job->y1 + (int32_t)((int64_t)rows * (idx + 1) / stripe_cnt) - 1;
+
+    if(y1 <= y2) fbdev_copy_rows(dsc, job, y1, y2);
+}
+
+static void * fbdev_stripes_worker(void * arg)
+{
+    fbdev_device_t * dsc = arg;
+
+    pthread_mutex_lock(&dsc->stripes.lock);
+    uint32_t idx = ++dsc->stripes.next_idx;
+    uint32_t generation = 0;    /*A job might be started before this thread runs*/
+
+    while(1) {
+        while(generation == dsc->stripes.generation && !dsc->stripes.exit) {
+            pthread_cond_wait(&dsc->stripes.start_cond, &dsc->stripes.lock);
+        }
+
+        if(dsc->stripes.exit) break;
+        generation = dsc->stripes.generation;
+
+        pthread_mutex_unlock(&dsc->stripes.lock);
+        fbdev_stripe_copy(dsc, idx);
+        pthread_mutex_lock(&dsc->stripes.lock);
+
+        if(--dsc->stripes.remaining == 0) {
+            pthread_cond_signal(&dsc->stripes.done_cond);
+        }
+    }
+    pthread_mutex_unlock(&dsc->stripes.lock);
+
+    return NULL;
+}
+
+#endif /*FBDEV_COPY_THREADS*/
+
+/*=====================
+ * Rotation
+ *====================*/
+
+#if LV_COLOR_DEPTH == 32 && (FBDEV_SSE2 || FBDEV_NEON)
+/*Transpose 4x4 pixels*/
+static inline void px_transpose_4x4(uint32_t * dst, uint32_t dst_stride, const uint32_t * src, int32_t src_stride)
+{
+#if FBDEV_SSE2
+    __m128i r0 = _mm_loadu_si128((const __m128i *)src);
+    __m128i r1 = _mm_loadu_si128((const __m128i *)(src + src_stride));
+    __m128i r2 = _mm_loadu_si128((const __m128i *)(src + 2 * src_stride));
+    __m128i r3 = _mm_loadu_si128((const __m128i *)(src + 3 * src_stride));
+    __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+    __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+    __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+    __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+    _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi64(t0, t1));
+    _mm_storeu_si128((__m128i *)(dst + dst_stride), _mm_unpackhi_epi64(t0, t1));
+    _mm_storeu_si128((__m128i *)(dst + 2 * dst_stride), _mm_unpacklo_epi64(t2, t3));
+    _mm_storeu_si128((__m128i *)(dst + 3 * dst_stride), _mm_unpackhi_epi64(t2, t3));
+#else
+    uint32x4x2_t t01 = vtrnq_u32(vld1q_u32(src), vld1q_u32(src + src_stride));
+    uint32x4x2_t t23 = vtrnq_u32(vld1q_u32(src + 2 * src_stride), vld1q_u32(src + 3 * src_stride));
+    vst1q_u32(dst, vcombine_u32(vget_low_u32(t01.val[0]), vget_low_u32(t23.val[0])));
+    vst1q_u32(dst + dst_stride, vcombine_u32(vget_low_u32(t01.val[1]), vget_low_u32(t23.val[1])));
+    vst1q_u32(dst + 2 * dst_stride, vcombine_u32(vget_high_u32(t01.val[0]), vget_high_u32(t23.val[0])));
+    vst1q_u32(dst + 3 * dst_stride, vcombine_u32(vget_high_u32(t01.val[1]), vget_high_u32(t23.val[1])));
+#endif
+}
+#define PX_TRANSPOSE_BLOCK 4
+#define PX_TRANSPOSE_TYPE uint32_t
+
+#elif LV_COLOR_DEPTH == 16 && (FBDEV_SSE2 || FBDEV_NEON)
+/*Transpose 8x8 pixels*/
+static inline void px_transpose_8x8(uint16_t * dst, uint32_t dst_stride, const uint16_t * src, int32_t src_stride)
+{
+#if FBDEV_SSE2
+    __m128i a[8];
+    __m128i b[8];
+    int i;
+    for(i = 0; i < 8; i++) a[i] = _mm_loadu_si128((const __m128i *)(src + i * src_stride));
+    for(i = 0; i < 4; i++) {
+        b[2 * i] = _mm_unpacklo_epi16(a[2 * i], a[2 * i + 1]);
+        b[2 * i + 1] = _mm_unpackhi_epi16(a[2 * i], a[2 * i + 1]);
+    }
+    /*a[0..3]: columns 0-1, 2-3, 4-5, 6-7 of rows 0-3, a[4..7]: the same of rows 4-7*/
+    for(i = 0; i < 2; i++) {
+        a[4 * i] = _mm_unpacklo_epi32(b[4 * i], b[4 * i + 2]);
+        a[4 * i + 1] = _mm_unpackhi_epi32(b[4 * i], b[4 * i + 2]);
+        a[4 * i + 2] = _mm_unpacklo_epi32(b[4 * i + 1], b[4 * i + 3]);
+        a[4 * i + 3] = _mm_unpackhi_epi32(b[4 * i + 1], b[4 * i + 3]);
+    }
+    for(i = 0; i < 4; i++) {
+        _mm_storeu_si128((__m128i *)(dst + 2 * i * dst_stride), _mm_unpacklo_epi64(a[i], a[i + 4]));
+        _mm_storeu_si128((__m128i *)(dst + (2 * i + 1) * dst_stride), _mm_unpackhi_epi64(a[i], a[i + 4]));
+    }
+#else
+    uint16x8x2_t b[4];
+    uint32x4x2_t c[4];
+    int i;
+    for(i = 0; i < 4; i++) {
+        b[i] = vzipq_u16(vld1q_u16(src + 2 * i * src_stride), vld1q_u16(src + (2 * i + 1) * src_stride));
+    }
+    /*c[0], c[1]: columns 0-1, 2-3 and 4-5, 6-7 of rows 0-3, c[2], c[3]: the same of rows 4-7*/
+    for(i = 0; i < 2; i++) {
+        c[2 * i] = vzipq_u32(vreinterpretq_u32_u16(b[2 * i].val[0]), vreinterpretq_u32_u16(b[2 * i + 1].val[0]));
+        c[2 * i + 1] = vzipq_u32(vreinterpretq_u32_u16(b[2 * i].val[1]), vreinterpretq_u32_u16(b[2 * i + 1].val[1]));
+    }
+    for(i = 0; i < 4; i++) {
+        uint32x4_t lo = c[i / 2].val[i % 2];
+        uint32x4_t hi = c[2 + i / 2].val[i % 2];
+        vst1q_u16(dst + 2 * i * dst_stride, vreinterpretq_u16_u32(vcombine_u32(vget_low_u32(lo), vget_low_u32(hi))));
+        vst1q_u16(dst + (2 * i + 1) * dst_stride,
+                  vreinterpretq_u16_u32(vcombine_u32(vget_high_u32(lo), vget_high_u32(hi))));
+    }
+#endif
+}
+#define PX_TRANSPOSE_BLOCK 8
+#define PX_TRANSPOSE_TYPE uint16_t
+#endif
+
+/**
+ * Transpose pixels: the columns of `src` become the rows of `dst`.
+ * @param dst destination, `w` rows of `h` pixels
+ * @param dst_stride distance of the rows in `dst` in pixels
+ * @param src source, `h` rows of `w` pixels
+ * @param src_stride distance of the rows in `src` in pixels, negative to go upwards
+ * @param w width of the source
+ * @param h height of the source
+ */
+static void px_transpose(lv_color_t * dst, uint32_t dst_stride, const lv_color_t * src, int32_t src_stride,
+                         uint32_t w, uint32_t h)
+{
+    uint32_t i = 0;
+    uint32_t j;
+
+#ifdef PX_TRANSPOSE_BLOCK
+    for(; i + PX_TRANSPOSE_BLOCK <= h; i += PX_TRANSPOSE_BLOCK) {
+        const lv_color_t * s = src + (int32_t)i * src_stride;
+        for(j = 0; j + PX_TRANSPOSE_BLOCK <= w; j += PX_TRANSPOSE_BLOCK) {
+#if PX_TRANSPOSE_BLOCK == 4
+            px_transpose_4x4((PX_TRANSPOSE_TYPE *)&dst[j * dst_stride + i], dst_stride,
+                             (const PX_TRANSPOSE_TYPE *)&s[j], src_stride);
+#else
+            px_transpose_8x8((PX_TRANSPOSE_TYPE *)&dst[j * dst_stride + i], dst_stride,
+                             (const PX_TRANSPOSE_TYPE *)&s[j], src_stride);
+#endif
+        }
+        for(; j < w; j++) {
+            uint32_t k;
+            for(k = 0; k < PX_TRANSPOSE_BLOCK; k++) {
+                dst[j * dst_stride + i + k] = s[(int32_t)k * src_stride + (int32_t)j];
+            }
+        }
+    }
+#endif
+
+    for(; i < h; i++) {
+        const lv_color_t * s = src + (int32_t)i * src_stride;
+        for(j = 0; j < w; j++) dst[j * dst_stride + i] = s[j];
+    }
+}
+
+/*=====================
+ * Pixel conversion
+ *====================*/
+
+/* The framebuffer is expected to be XRGB8888 (32bpp), RGB888 in B, G, R byte order (24bpp),
+ * RGB565 (16bpp) or RGB332 (8bpp), i.e. the formats LVGL uses for the same color depths.
+ * The kernels don't need aligned rows and don't touch anything past `px_cnt` pixels.*/
+
+#if FBDEV_SSE2 && LV_COLOR_DEPTH == 32
+/*4 XRGB8888 pixels to RGB565, sign extended in 32 bit lanes for `_mm_packs_epi32`*/
+static inline __m128i px_sse2_xrgb8888_to_rgb565(__m128i c)
+{
+    __m128i r = _mm_and_si128(_mm_srli_epi32(c, 8), _mm_set1_epi32(0xF800));
+    __m128i g = _mm_and_si128(_mm_srli_epi32(c, 5), _mm_set1_epi32(0x07E0));
+    __m128i b = _mm_and_si128(_mm_srli_epi32(c, 3), _mm_set1_epi32(0x001F));
+    c = _mm_or_si128(_mm_or_si128(r, g), b);
+    return _mm_srai_epi32(_mm_slli_epi32(c, 16), 16);
+}
+#elif FBDEV_SSE2 && LV_COLOR_DEPTH == 16
+/*4 RGB565 pixels in 32 bit lanes to XRGB8888*/
+static inline __m128i px_sse2_rgb565_to_xrgb8888(__m128i c)
+{
+    __m128i r = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(c, _mm_set1_epi32(0xF800)), 8),
+                             _mm_slli_epi32(_mm_and_si128(c, _mm_set1_epi32(0xE000)), 3));
+    __m128i g = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(c, _mm_set1_epi32(0x07E0)), 5),
+                             _mm_srli_epi32(_mm_and_si128(c, _mm_set1_epi32(0x0600)), 1));
+    __m128i b = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(c, _mm_set1_epi32(0x001F)), 3),
+                             _mm_srli_epi32(_mm_and_si128(c, _mm_set1_epi32(0x001C)), 2));
+    return _mm_or_si128(_mm_or_si128(r, g), _mm_or_si128(b, _mm_set1_epi32((int)0xFF000000)));
+}
+#endif
+
+static void px_copy(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt)
+{
+    memcpy(dst, src, px_cnt * sizeof(lv_color_t));
+}
+
+static void px_copy_stream(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt)
+{
+    fb_stream_copy(dst, (const uint8_t *)src, px_cnt * sizeof(lv_color_t));
+}
+
+#if LV_COLOR_DEPTH == 32
+
+static void px_xrgb8888_to_rgb888(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt)
+{
+    const uint8_t * src8 = (const uint8_t *)src;
+    uint32_t i = 0;
+
+#if FBDEV_NEON
+    for(; i + 16 <= px_cnt; i += 16) {
+        uint8x16x4_t px = vld4q_u8(src8 + i * 4);
+        uint8x16x3_t out = {{px.val[0], px.val[1], px.val[2]}};
+        vst3q_u8(dst + i * 3, out);
+    }
+#endif
+
+    for(; i < px_cnt; i++) {
+        dst[i * 3] = src8[i * 4];
+        dst[i * 3 + 1] = src8[i * 4 + 1];
+        dst[i * 3 + 2] = src8[i * 4 + 2];
+    }
+}
+
+#if FBDEV_SSSE3_DISPATCH
+__attribute__((target("ssse3")))
+static void px_xrgb8888_to_rgb888_ssse3(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt)
+{
+    const uint8_t * src8 = (const uint8_t *)src;
+    const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    uint32_t i = 0;
+
+    /*Pack 16 pixels into 3 full 16 byte stores*/
+    for(; i + 16 <= px_cnt; i += 16) {
+        __m128i p0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src8 + i * 4)), pack);
+        __m128i p1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src8 + i * 4 + 16)), pack);
+        __m128i p2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src8 + i * 4 + 32)), pack);
+        __m128i p3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src8 + i * 4 + 48)), pack);
+        _mm_storeu_si128((__m128i *)(dst + i * 3), _mm_or_si128(p0, _mm_slli_si128(p1, 12)));
+        _mm_storeu_si128((__m128i *)(dst + i * 3 + 16), _mm_or_si128(_mm_srli_si128(p1, 4), _mm_slli_si128(p2, 8)));
+        _mm_storeu_si128((__m128i *)(dst + i * 3 + 32), _mm_or_si128(_mm_srli_si128(p2, 8), _mm_slli_si128(p3, 4)));
+    }
+
+    if(i < px_cnt) px_xrgb8888_to_rgb888(dst + i * 3, src + i, px_cnt - i);
+}
+#endif /*FBDEV_SSSE3_DISPATCH*/
+
+static void px_xrgb8888_to_rgb565(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt)
+{
+    const uint32_t * src32 = (const uint32_t *)src;
+    uint16_t * dst16 = (uint16_t *)dst;
+    uint32_t i = 0;
+
+#if FBDEV_NEON
+    for(; i + 16 <= px_cnt; i += 16) {
+        uint8x16x4_t px = vld4q_u8((const uint8_t *)(src32 + i));
+        uint16x8_t lo = vshll_n_u8(vget_low_u8(px.val[2]), 8);
+        uint16x8_t hi = vshll_n_u8(vget_high_u8(px.val[2]), 8);
+        lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(px.val[1]), 8), 5);
+        hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(px.val[1]), 8), 5);
+        lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(px.val[0]), 8), 11);
+        hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(px.val[0]), 8), 11);
+        vst1q_u16(dst16 + i, lo);
+        vst1q_u16(dst16 + i + 8, hi);
+    }
+#elif FBDEV_SSE2
+    for(; i + 8 <= px_cnt; i += 8) {
+        __m128i a = px_sse2_xrgb8888_to_rgb565(_mm_loadu_si128((const __m128i *)(src32 + i)));
+        __m128i b = px_sse2_xrgb8888_to_rgb565(_mm_loadu_si128((const __m128i *)(src32 + i + 4)));
+        _mm_storeu_si128((__m128i *)(dst16 + i), _mm_packs_epi32(a, b));
+    }
+#endif
+
+    for(; i < px_cnt; i++) {
+        uint32_t c = src32[i];
+        dst16[i] = ((c >> 8) & 0xF800) | ((c >> 5) & 0x07E0) | ((c >> 3) & 0x001F);
+    }
+}
+
+static void px_xrgb8888_to_rgb332(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt)
+{
+    uint32_t i;
+    for(i = 0; i < px_cnt; i++) {
+        uint32_t c = src[i].full;
+        dst[i] = ((c >> 16) & 0xE0) | ((c >> 11) & 0x1C) | ((c >> 6) & 0x03);
+    }
+}
+
+#elif LV_COLOR_DEPTH == 16
+
+static void px_rgb565_to_xrgb8888(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt)
+{
+    const uint16_t * src16 = (const uint16_t *)src;
+    uint32_t * dst32 = (uint32_t *)dst;
+    uint32_t i = 0;
+
+#if FBDEV_NEON
+    for(; i + 8 <= px_cnt; i += 8) {
+        uint16x8_t c = vld1q_u16(src16 + i);
+        uint8x8_t r = vshrn_n_u16(c, 8);
+        uint8x8_t g = vshrn_n_u16(c, 3);
+        uint8x8_t b = vmovn_u16(vshlq_n_u16(c, 3));
+        uint8x8x4_t out;
+        /*Replicate the top bits into the low ones, so that white stays white*/
+        out.val[0] = vsri_n_u8(b, b, 5);
+        out.val[1] = vsri_n_u8(g, g, 6);
+        out.val[2] = vsri_n_u8(r, r, 5);
+        out.val[3] = vdup_n_u8(0xFF);
+        vst4_u8((uint8_t *)(dst32 + i), out);
+    }
+#elif FBDEV_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    for(; i + 8 <= px_cnt; i += 8) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(src16 + i));
+        _mm_storeu_si128((__m128i *)(dst32 + i), px_sse2_rgb565_to_xrgb8888(_mm_unpacklo_epi16(c, zero)));
+        _mm_storeu_si128((__m128i *)(dst32 + i + 4), px_sse2_rgb565_to_xrgb8888(_mm_unpackhi_epi16(c, zero)));
+    }
+#endif
+
+    for(; i < px_cnt; i++) {
+        uint32_t c = src16[i];
+        dst32[i] = 0xFF000000 |
+                   ((c & 0xF800) << 8) | ((c & 0xE000) << 3) |
+                   ((c & 0x07E0) << 5) | ((c & 0x0600) >> 1) |
+                   ((c & 0x001F) << 3) | ((c & 0x001C) >> 2);
+    }
+}
+
+static void px_rgb565_to_rgb888(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt)
+{
+    const uint16_t * src16 = (const uint16_t *)src;
+    uint32_t i;
+    for(i = 0; i < px_cnt; i++) {
+        uint32_t c = src16[i];
+        dst[i * 3] = ((c & 0x001F) << 3) | ((c & 0x001C) >> 2);
+        dst[i * 3 + 1] = ((c & 0x07E0) >> 3) | ((c & 0x0600) >> 9);
+        dst[i * 3 + 2] = ((c & 0xF800) >> 8) | ((c & 0xE000) >> 13);
+    }
+}
+
+static void px_rgb565_to_rgb332(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt)
+{
+    const uint16_t * src16 = (const uint16_t *)src;
+    uint32_t i;
+    for(i = 0; i < px_cnt; i++) {
+        uint32_t c = src16[i];
+        dst[i] = ((c >> 8) & 0xE0) | ((c >> 6) & 0x1C) | ((c >> 3) & 0x03);
+    }
+}
+
+#elif LV_COLOR_DEPTH == 8
+
+/*Only 256 colors: expand them with a lookup table*/
+static uint32_t rgb332_lut[256];
+
+static void px_rgb332_lut_init(void)
+{
+    uint32_t i;
+    for(i = 0; i < 256; i++) {
+        uint32_t r = (i >> 5) & 0x07;
+        uint32_t g = (i >> 2) & 0x07;
+        uint32_t b = i & 0x03;
+        rgb332_lut[i] = 0xFF000000 | (((r * 255) / 7) << 16) | (((g * 255) / 7) << 8) | ((b * 255) / 3);
+    }
+}
+
+static void px_rgb332_to_xrgb8888(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt)
+{
+    const uint8_t * src8 = (const uint8_t *)src;
+    uint32_t * dst32 = (uint32_t *)dst;
+    uint32_t i;
+    for(i = 0; i < px_cnt; i++) dst32[i] = rgb332_lut[src8[i]];
+}
+
+static void px_rgb332_to_rgb888(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt)
+{
+    const uint8_t * src8 = (const uint8_t *)src;
+    uint32_t i;
+    for(i = 0; i < px_cnt; i++) {
+        uint32_t c = rgb332_lut[src8[i]];
+        dst[i * 3] = c & 0xFF;
+        dst[i * 3 + 1] = (c >> 8) & 0xFF;
+        dst[i * 3 + 2] = (c >> 16) & 0xFF;
+    }
+}
+
+static void px_rgb332_to_rgb565(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt)
+{
+    const uint8_t * src8 = (const uint8_t *)src;
+    uint16_t * dst16 = (uint16_t *)dst;
+    uint32_t i;
+    for(i = 0; i < px_cnt; i++) {
+        uint32_t c = rgb332_lut[src8[i]];
+        dst16[i] = ((c >> 8) & 0xF800) | ((c >> 5) & 0x07E0) | ((c >> 3) & 0x001F);
+    }
+}
+
+#endif /*LV_COLOR_DEPTH*/
+
+static inline uint8_t px_to_1bpp(lv_color_t c)
+{
+#if LV_COLOR_DEPTH == 1
+    return c.full;
+#else
+    return lv_color_brightness(c) > 127;
+#endif
+}
+
+/**
+ * Pack a row of pixels into a 1bpp framebuffer row (the first pixel is the least significant bit).
+ * Full bytes are built in registers and written 4 or 1 at a time, only the partial bytes
+ * at the edges are read back to keep their other pixels.
+ * @param dst start of the framebuffer row
+ * @param x horizontal position of the first pixel in the row
+ * @param src pixels to pack
+ * @param px_cnt number of pixels
+ */
+static void px_pack_1bpp(uint8_t * dst, uint32_t x, const lv_color_t * src, uint32_t px_cnt)
+{
+    uint8_t * d = dst + x / 8;
+    uint32_t bit = x % 8;
+    uint32_t i = 0;
+    uint8_t mask;
+    uint8_t val;
+
+    /*Leading partial byte*/
+    if(bit) {
+        mask = 0;
+        val = 0;
+        for(; bit < 8 && i < px_cnt; bit++, i++) {
+            mask |= 1 << bit;
+            val |= px_to_1bpp(src[i]) << bit;
+        }
+        *d = (*d & ~mask) | val;
+        d++;
+    }
+
+    /*32 pixels at once*/
+    for(; i + 32 <= px_cnt; i += 32) {
+        uint8_t word[4] = {0};
+        for(bit = 0; bit < 32; bit++) {
+            word[bit / 8] |= px_to_1bpp(src[i + bit]) << (bit % 8);
+        }
+        memcpy(d, word, sizeof(word));
+        d += sizeof(word);
+    }
+
+    /*Remaining full bytes*/
+    for(; i + 8 <= px_cnt; i += 8) {
+        val = 0;
+        for(bit = 0; bit < 8; bit++) {
+            val |= px_to_1bpp(src[i + bit]) << bit;
+        }
+        *d++ = val;
+    }
+
+    /*Trailing partial byte*/
+    if(i < px_cnt) {
+        mask = 0;
+        val = 0;
+        for(bit = 0; i < px_cnt; bit++, i++) {
+            mask |= 1 << bit;
+            val |= px_to_1bpp(src[i]) << bit;
+        }
+        *d = (*d & ~mask) | val;
+    }
+}
+
+/*=====================
+ * Streaming stores
+ *====================*/
+
+/* Write-combined framebuffer memory is written fastest in whole, aligned 64 byte lines.
+ * Non-temporal stores also keep the framebuffer out of the caches, which are needed for rendering.*/
+
+/**
+ * Copy bytes within or into the framebuffer with the device's copy mode.
+ * @param dsc framebuffer device
+ * @param dst destination
+ * @param src source
+ * @param len number of bytes to copy
+ */
+static void fb_copy(fbdev_device_t * dsc, uint8_t * dst, const uint8_t * src, size_t len)
+{
+    if(dsc->copy_mode == FBDEV_COPY_STREAM) fb_stream_copy(dst, src, len);
+    else memcpy(dst, src, len);
+}
+
+/**
+ * Copy bytes with non-temporal stores. The head and tail which are not part of a whole
+ * 64 byte line of `dst` are copied with regular stores. Call `fb_stream_fence()` when done.
+ * @param dst destination
+ * @param src source, needn't be aligned
+ * @param len number of bytes to copy
+ */
+static void fb_stream_copy(uint8_t * dst, const uint8_t * src, size_t len)
+{
+#if FBDEV_SSE2 || FBDEV_NEON
+    size_t head = (64 - ((uintptr_t)dst & 63)) & 63;
+    if(len < head + 64) {
+        memcpy(dst, src, len);
+        return;
+    }
+
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    len -= head;
+
+    while(len >= 64) {
+#if FBDEV_SSE2
+        __m128i a = _mm_loadu_si128((const __m128i *)src);
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+        _mm_stream_si128((__m128i *)dst, a);
+        _mm_stream_si128((__m128i *)(dst + 16), b);
+        _mm_stream_si128((__m128i *)(dst + 32), c);
+        _mm_stream_si128((__m128i *)(dst + 48), d);
+#elif defined(__aarch64__)
+        /*There is no intrinsic for STNP, the non-temporal pair store*/
+        uint8x16_t a = vld1q_u8(src);
+        uint8x16_t b = vld1q_u8(src + 16);
+        uint8x16_t c = vld1q_u8(src + 32);
+        uint8x16_t d = vld1q_u8(src + 48);
+        __asm__ volatile("stnp %q1, %q2, [%0]\n\t"
+                         "stnp %q3, %q4, [%0, #32]"
+                         : : "r"(dst), "w"(a), "w"(b), "w"(c), "w"(d) : "memory");
+#else
+        /*32 bit ARM has no non-temporal stores, but full line writes
+         *don't need the line to be read first*/
+        uint8x16_t a = vld1q_u8(src);
+        uint8x16_t b = vld1q_u8(src + 16);
+        uint8x16_t c = vld1q_u8(src + 32);
+        uint8x16_t d = vld1q_u8(src + 48);
+        vst1q_u8(dst, a);
+        vst1q_u8(dst + 16, b);
+        vst1q_u8(dst + 32, c);
+        vst1q_u8(dst + 48, d);
+#endif
+        dst += 64;
+        src += 64;
+        len -= 64;
+    }
+
+    memcpy(dst, src, len);
+#else
+    memcpy(dst, src, len);
+#endif
+}
+
+/**
+ * Convert pixels into the framebuffer with non-temporal stores: they are converted
+ * into a cached buffer chunk by chunk, which is then streamed out with `fb_stream_copy()`.
+ * Call `fb_stream_fence()` when done.
+ * @param dsc framebuffer device
+ * @param dst destination in the framebuffer
+ * @param src pixels to convert
+ * @param px_cnt number of pixels
+ */
+static void fb_stream_conv(fbdev_device_t * dsc, uint8_t * dst, const lv_color_t * src, uint32_t px_cnt)
+{
+    uint32_t line[FBDEV_STREAM_CHUNK_PX];   /*32 bit for the alignment the kernels expect*/
+    uint32_t px_size = dsc->vinfo.bits_per_pixel / 8;
+    uint32_t n = 0;
+
+    /*Convert the pixels before the first 64 byte line directly, the later chunks end on line boundaries.
+     *If no pixel starts a line (odd addresses at 16 or 32bpp) the chunks just start anywhere.*/
+    while(n < px_cnt && n < 64 && ((uintptr_t)dst + n * px_size) % 64 != 0) n++;
+    if(n == 64) n = 0;
+    if(n > 0) dsc->px_conv(dst, src, n);
+
+    while(n < px_cnt) {
+        uint32_t len = LV_MIN(FBDEV_STREAM_CHUNK_PX, px_cnt - n);
+        dsc->px_conv((uint8_t *)line, src + n, len);
+        fb_stream_copy(dst + n * px_size, (const uint8_t *)line, len * px_size);
+        n += len;
+    }
+}
+
+/**
+ * Wait until the streamed stores are visible to the display controller.
+ */
+static void fb_stream_fence(void)
+{
+#if FBDEV_SSE2
+    _mm_sfence();
+#else
+    __sync_synchronize();
+#endif
+}
+
+/**
+ * Select the pixel conversion for the framebuffer's color depth.
+ * @param bits_per_pixel color depth of the framebuffer
+ * @param mode stream plain copies with non-temporal stores if FBDEV_COPY_STREAM
+ * @return the conversion or NULL if the color depth is not supported
+ */
+static fbdev_px_conv_t fbdev_select_px_conv(uint32_t bits_per_pixel, fbdev_copy_mode_t mode)
+{
+    if(bits_per_pixel == LV_COLOR_DEPTH && LV_COLOR_DEPTH >= 8) {
+        return mode == FBDEV_COPY_STREAM ? px_copy_stream : px_copy;
+    }
+
+#if LV_COLOR_DEPTH == 32
+    switch(bits_per_pixel) {
+        case 24:
+#if FBDEV_SSSE3_DISPATCH
+            if(__builtin_cpu_supports("ssse3")) return px_xrgb8888_to_rgb888_ssse3;
+#endif
+            return px_xrgb8888_to_rgb888;
+        case 16:
+            return px_xrgb8888_to_rgb565;
+        case 8:
+            return px_xrgb8888_to_rgb332;
+    }
+#elif LV_COLOR_DEPTH == 16
+    switch(bits_per_pixel) {
+        case 32:
+            return px_rgb565_to_xrgb8888;
+        case 24:
+            return px_rgb565_to_rgb888;
+        case 8:
+            return px_rgb565_to_rgb332;
+    }
+#elif LV_COLOR_DEPTH == 8
+    px_rgb332_lut_init();
+    switch(bits_per_pixel) {
+        case 32:
+            return px_rgb332_to_xrgb8888;
+        case 24:
+            return px_rgb332_to_rgb888;
+        case 16:
+            return px_rgb332_to_rgb565;
+    }
+#endif
+
+    return NULL;
+}
 
 #endif
@@ -29,28 +29,346 @@ extern "C" {
 #include "lvgl/lvgl.h"
 #endif
 
+#if !USE_BSD_FBDEV
+#include <linux/fb.h>
+#endif
+
+#ifndef FBDEV_ASYNC_FLUSH
+#define FBDEV_ASYNC_FLUSH  0
+#endif
+
+/*Default copy mode of new devices: 0: memcpy, 1: non-temporal stores*/
+#ifndef FBDEV_STREAM_COPY
+#define FBDEV_STREAM_COPY  0
+#endif
+
+#ifndef FBDEV_COPY_THREADS
+#define FBDEV_COPY_THREADS  0
+#endif
+
+/*Measure the time spent copying into the framebuffer*/
+#ifndef FBDEV_FLUSH_STATS
+#define FBDEV_FLUSH_STATS  0
+#endif
+
+/*Rotation set by `fbdev_disp_drv_init`: 0, 90, 180 or 270*/
+#ifndef FBDEV_ROTATION
+#define FBDEV_ROTATION  0
+#endif
+
+/*Smaller areas are copied by the flushing thread alone*/
+#ifndef FBDEV_COPY_THREAD_MIN_PX
+#define FBDEV_COPY_THREAD_MIN_PX  (128 * 1024)
+#endif
+
+#if FBDEV_ASYNC_FLUSH || FBDEV_COPY_THREADS > 0
+#include <pthread.h>
+#endif
+
 /*********************
  *      DEFINES
  *********************/
+#ifndef FBDEV_BUFFER_COUNT
+#define FBDEV_BUFFER_COUNT  1
+#endif
+
+#if FBDEV_BUFFER_COUNT < 1
+#error "FBDEV_BUFFER_COUNT must be at least 1"
+#endif
+
+/*Areas remembered per page for page flipping, more damage invalidates the whole page*/
+#ifndef FBDEV_DMG_CAPACITY
+#define FBDEV_DMG_CAPACITY  16
+#endif
 
 /**********************
  *      TYPEDEFS
  **********************/
 
+struct bsd_fb_var_info{
+    uint32_t xoffset;
+    uint32_t yoffset;
+    uint32_t xres;
+    uint32_t yres;
+    int bits_per_pixel;
+ };
+
+struct bsd_fb_fix_info{
+    long int line_length;
+    long int smem_len;
+};
+
+/*Areas flushed into a page during its last frame*/
+typedef struct {
+    lv_area_t areas[FBDEV_DMG_CAPACITY];
+    uint32_t cnt;
+    bool full;  /*More damage than `areas` can hold: the whole page is dirty*/
+} fbdev_page_dmg_t;
+
+typedef enum {
+    FBDEV_COPY_MEMCPY,  /*Regular stores*/
+    FBDEV_COPY_STREAM,  /*Non-temporal stores bypassing the caches (SSE2 and NEON only)*/
+} fbdev_copy_mode_t;
+
+/*Convert a row of LVGL pixels to the pixel format of the framebuffer*/
+typedef void (*fbdev_px_conv_t)(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt);
+
+/*An area to copy into the framebuffer, already truncated to the screen.
+ *The coordinates are rotated like LVGL's, the driver rotates the pixels while copying.*/
+typedef struct {
+    int32_t x1;
+    int32_t y1;
+    int32_t y2;
+    lv_coord_t w;
+    lv_coord_t src_w;             /*Width of a row in `color_p`*/
+    uint32_t yoffset;             /*First row of the page to draw into*/
+    const lv_color_t * color_p;   /*First pixel to copy*/
+    lv_disp_rot_t rot;
+} fbdev_copy_job_t;
+
+/*Statistics of the copies into the framebuffer*/
+typedef struct {
+    uint32_t flush_cnt;     /*Number of flushed areas*/
+    uint64_t px_cnt;        /*Pixels written*/
+    uint64_t byte_cnt;      /*Bytes written*/
+    uint64_t time_ns;       /*Total time spent copying*/
+    uint32_t max_ns;        /*Slowest flush*/
+    uint32_t hist[32];      /*Number of flushes taking 2^i ... 2^(i+1) - 1 ns*/
+} fbdev_flush_stats_t;
+
+typedef struct {
+    /*Device*/
+    int fd;
+    char * fbp;
+    long int screensize;
+#if USE_BSD_FBDEV
+    struct bsd_fb_var_info vinfo;
+    struct bsd_fb_fix_info finfo;
+#else
+    struct fb_var_screeninfo vinfo;
+    struct fb_fix_screeninfo finfo;
+#endif
+    bool vsync_unsupported;
+    bool fake;               /*Backed by a regular file or memfd, not a framebuffer device*/
+    /*Page flipping*/
+    uint32_t page_cnt;       /*Number of pages in the virtual framebuffer*/
+    uint32_t back_page;      /*Page the current frame is drawn into*/
+    uint32_t pending_flips;  /*Pans issued since the last vertical sync*/
+    uint64_t pan_ns;         /*Time of the last pan*/
+    uint32_t pan_vblank;     /*Vertical sync count of the driver at the last pan*/
+    bool vblank_count;       /*The driver counts the vertical syncs (FBIOGET_VBLANK)*/
+    uint64_t vsync_ns;       /*Time of the last vertical sync waited for, 0 if none*/
+    uint64_t vsync_period_ns;/*Refresh period from the video timings, 0 if unknown*/
+    bool frame_started;      /*The back page was already synchronized for this frame*/
+    fbdev_page_dmg_t page_dmg[FBDEV_BUFFER_COUNT];
+    /*Drawing*/
+    fbdev_copy_mode_t copy_mode;
+    fbdev_px_conv_t px_conv;
+    lv_disp_draw_buf_t draw_buf;
+    lv_color_t * bufs[2];    /*Draw buffers allocated by `fbdev_device_disp_drv_init`*/
+#if FBDEV_FLUSH_STATS
+    fbdev_flush_stats_t stats;
+#endif
+#if FBDEV_COPY_THREADS > 0
+    /*Copy threads for large areas*/
+    struct {
+        pthread_t threads[FBDEV_COPY_THREADS];
+        uint32_t thread_cnt;    /*Number of threads started*/
+        uint32_t next_idx;
+        pthread_mutex_t lock;
+        pthread_cond_t start_cond;
+        pthread_cond_t done_cond;
+        uint32_t generation;    /*Incremented for every job*/
+        uint32_t remaining;     /*Threads still copying the job*/
+        bool exit;
+        fbdev_copy_job_t job;
+    } stripes;
+#endif
+#if FBDEV_ASYNC_FLUSH
+    /*Flush thread*/
+    struct {
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;    /*Signals a new flush, a finished flush and exit*/
+        bool running;
+        bool exit;
+        bool pending;           /*The flush below is queued*/
+        bool busy;              /*A flush is in progress*/
+        lv_disp_drv_t * drv;
+        lv_area_t area;
+        lv_color_t * color_p;
+    } async;
+#endif
+} fbdev_device_t;
+
 /**********************
  * GLOBAL PROTOTYPES
  **********************/
+
+/**
+ * Initialize the global framebuffer device, as configured with FBDEV_PATH.
+ */
 void fbdev_init(void);
+/**
+ * Initialize a framebuffer device.
+ * @param dsc framebuffer device
+ */
+void fbdev_device_init(fbdev_device_t * dsc);
+
+/**
+ * Open and map a framebuffer device.
+ * @param dsc framebuffer device
+ * @param dev_path device path, e.g., /dev/fb1, or NULL to close
+ * @return whether the device was successfully opened and mapped
+ */
+bool fbdev_device_set_file(fbdev_device_t * dsc, const char * dev_path);
+
+/**
+ * Use a regular file or memfd instead of a framebuffer device, e.g. to measure the flush
+ * performance without a display (see bench/fbdev_bench.c). The file is resized to hold
+ * FBDEV_BUFFER_COUNT pages.
+ * @param dsc framebuffer device
+ * @param fd file descriptor opened for reading and writing, closed with the device
+ * @param xres horizontal resolution
+ * @param yres vertical resolution
+ * @param bpp bits per pixel: 1, 8, 16, 24 or 32
+ * @param line_length bytes per line, 0 to calculate it from `xres` and `bpp`
+ * @return whether the file was successfully resized and mapped
+ */
+bool fbdev_device_set_fake_file(fbdev_device_t * dsc, int fd, uint32_t xres, uint32_t yres, uint32_t bpp,
+                                uint32_t line_length);
+
+/**
+ * Initialize the global framebuffer device and a display driver for it.
+ * See `fbdev_device_disp_drv_init`.
+ * @param disp_drv display driver to initialize, register it with `lv_disp_drv_register()`
+ * @return 0 on success, -1 if the framebuffer couldn't be opened
+ */
+int fbdev_disp_drv_init(lv_disp_drv_t * disp_drv);
+/**
+ * Initialize a display driver for an opened framebuffer device.
+ * If the pixel format and the stride of the framebuffer match LVGL's, LVGL
+ * draws directly into the framebuffer pages (`direct_mode`) and nothing is copied on flush.
+ * Otherwise draw buffers are allocated and `fbdev_flush` copies from them.
+ * @param dsc framebuffer device
+ * @param disp_drv display driver to initialize, register it with `lv_disp_drv_register()`
+ * @return 0 on success, -1 on failure
+ */
+int fbdev_device_disp_drv_init(fbdev_device_t * dsc, lv_disp_drv_t * disp_drv);
+
+/**
+ * Close the global framebuffer device.
+ */
 void fbdev_exit(void);
+/**
+ * Unmap and close a framebuffer device and free its draw buffers.
+ * @param dsc framebuffer device
+ */
+void fbdev_device_exit(fbdev_device_t * dsc);
+
+/**
+ * Flush callback for the display driver.
+ * @param drv display driver where drv->user_data is NULL for the global framebuffer
+ *            device or an fbdev_device_t pointer.
+ * @param area an area where to copy `color_p`
+ * @param color_p an array of pixels to copy to the `area` part of the screen
+ */
 void fbdev_flush(lv_disp_drv_t * drv, const lv_area_t * area, lv_color_t * color_p);
+/**
+ * Wait callback for page flipping (FBDEV_BUFFER_COUNT > 1) and FBDEV_ASYNC_FLUSH.
+ * Waits for the vertical sync, so that the next back page is no longer scanned out,
+ * or for the flush thread to finish copying.
+ * Assign it to `disp_drv->wait_cb` to let LVGL wait for the flip.
+ * @param drv display driver where drv->user_data is NULL for the global framebuffer
+ *            device or an fbdev_device_t pointer.
+ */
+void fbdev_wait_vsync(lv_disp_drv_t * drv);
+
 void fbdev_get_sizes(uint32_t *width, uint32_t *height, uint32_t *dpi);
+/**
+ * Get the resolution of a framebuffer device.
+ * @param dsc framebuffer device
+ * @param width destination for the horizontal resolution or NULL
+ * @param height destination for the vertical resolution or NULL
+ * @param dpi destination for the DPI or NULL, left unchanged if unknown
+ */
+void fbdev_device_get_sizes(fbdev_device_t * dsc, uint32_t * width, uint32_t * height, uint32_t * dpi);
+
 /**
  * Set the X and Y offset in the variable framebuffer info.
+ * With page flipping the Y offset is managed by the driver.
  * @param xoffset horizontal offset
  * @param yoffset vertical offset
  */
 void fbdev_set_offset(uint32_t xoffset, uint32_t yoffset);
+/**
+ * Set the X and Y offset in the variable framebuffer info of a framebuffer device.
+ * @param dsc framebuffer device
+ * @param xoffset horizontal offset
+ * @param yoffset vertical offset
+ */
+void fbdev_device_set_offset(fbdev_device_t * dsc, uint32_t xoffset, uint32_t yoffset);
+
+/**
+ * Select how pixels are written into the framebuffer.
+ * Non-temporal stores avoid polluting the caches with the uncached or write-combined
+ * framebuffer memory. Don't call it while a flush is in progress.
+ * @param mode FBDEV_COPY_MEMCPY or FBDEV_COPY_STREAM
+ */
+void fbdev_set_copy_mode(fbdev_copy_mode_t mode);
+/**
+ * Select how pixels are written into a framebuffer device.
+ * Don't call it while a flush is in progress.
+ * @param dsc framebuffer device
+ * @param mode FBDEV_COPY_MEMCPY or FBDEV_COPY_STREAM
+ */
+void fbdev_device_set_copy_mode(fbdev_device_t * dsc, fbdev_copy_mode_t mode);
+
+#if FBDEV_FLUSH_STATS
+/**
+ * Get the statistics of the copies into a framebuffer device. With FBDEV_ASYNC_FLUSH
+ * call it when no flush is in progress, e.g. after `fbdev_wait_vsync()`.
+ * Throughput: `byte_cnt * 1000 / time_ns` MB/s, cost per pixel: `time_ns / px_cnt` ns.
+ * @param dsc framebuffer device
+ * @param stats the statistics are copied here
+ */
+void fbdev_device_get_flush_stats(fbdev_device_t * dsc, fbdev_flush_stats_t * stats);
+/**
+ * Clear the statistics of the copies into a framebuffer device.
+ * @param dsc framebuffer device
+ */
+void fbdev_device_reset_flush_stats(fbdev_device_t * dsc);
+/**
+ * Get a percentile of the flush latencies.
+ * @param stats statistics from `fbdev_device_get_flush_stats()`
+ * @param percent 0 ... 100, e.g. 50 for the median
+ * @return upper bound of the percentile in ns (a power of 2 minus 1), 0 if nothing was flushed
+ */
+uint32_t fbdev_flush_stats_percentile(const fbdev_flush_stats_t * stats, uint32_t percent);
+#endif
 
+#if FBDEV_COPY_THREADS > 0
+/**
+ * Pin a copy thread of a framebuffer device to a CPU (Linux only).
+ * @param dsc framebuffer device
+ * @param idx index of the copy thread, 0 ... FBDEV_COPY_THREADS - 1
+ * @param cpu the CPU to run the thread on
+ * @return whether the thread was pinned
+ */
+bool fbdev_device_set_copy_thread_cpu(fbdev_device_t * dsc, uint32_t idx, int cpu);
+#endif
+
+/**
+ * Get the number of framebuffer pages used for page flipping.
+ * @return 1 if page flipping is not used, FBDEV_BUFFER_COUNT otherwise
+ */
+uint32_t fbdev_get_buffer_count(void);
+/**
+ * Get the number of pages a framebuffer device uses for page flipping.
+ * @param dsc framebuffer device
+ * @return 1 if page flipping is not used, FBDEV_BUFFER_COUNT otherwise
+ */
+uint32_t fbdev_device_get_buffer_count(fbdev_device_t * dsc);
 
 /**********************
  *      MACROS
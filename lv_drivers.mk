@@ -1,5 +1,5 @@
 LV_DRIVERS_PATH ?= ${shell pwd}/lv_drivers
 
-CSRCS += $(shell find $(LV_DRIVERS_PATH) -type f -name '*.c')
+CSRCS += $(shell find $(LV_DRIVERS_PATH) -type f -name '*.c' -not -path '*/bench/*')
 CFLAGS += "-I$(LV_DRIVERS_PATH)"
 
@@ -331,6 +331,24 @@
 
 #if USE_FBDEV
 #  define FBDEV_PATH          "/dev/fb0"
+/*Number of pages in the virtual framebuffer: 2 or 3 for page flipped double/triple buffering
+ *(the rendered page is shown with FBIOPAN_DISPLAY, use `fbdev_wait_vsync` as `wait_cb`)*/
+#  define FBDEV_BUFFER_COUNT  1
+/*Copy the flushed areas to the framebuffer on a separate thread (needs pthread),
+ *so that LVGL can render into its second draw buffer meanwhile*/
+#  define FBDEV_ASYNC_FLUSH   0
+/*1: write the framebuffer with non-temporal (streaming) stores by default.
+ *Can be changed at runtime with `fbdev_set_copy_mode`*/
+#  define FBDEV_STREAM_COPY   0
+/*Number of extra threads (needs pthread) copying large areas in horizontal stripes.
+ *Pin them to CPUs with `fbdev_device_set_copy_thread_cpu`*/
+#  define FBDEV_COPY_THREADS  0
+/*Rotate the screen by 0, 90, 180 or 270 degrees while copying into the framebuffer.
+ *Replaces LVGL's `sw_rotate`, can be changed at runtime with `lv_disp_set_rotation`*/
+#  define FBDEV_ROTATION      0
+/*Measure the copies into the framebuffer, see `fbdev_device_get_flush_stats`*/
+#  define FBDEV_FLUSH_STATS   0
+#  define FBDEV_COPY_THREAD_MIN_PX  (128 * 1024)  /*Copy smaller areas on the flushing thread only*/
 #endif
 
 /*-----------------------------------------
@@ -354,6 +372,19 @@
 #if USE_DRM
 #  define DRM_CARD          "/dev/dri/card0"
 #  define DRM_CONNECTOR_ID  -1	/* -1 for the first connected one */
+#  define DRM_DAMAGE_CLIPS  16	/* Max. rectangles sent as FB_DAMAGE_CLIPS per frame, 0 to disable */
+#  define DRM_BUFFER_COUNT  2	/* Dumb buffers, 3 or more to go on rendering while a flip is pending */
+#  define DRM_SHADOW_BUFFER 0	/* 1: render into cached RAM and copy the damage into the dumb buffers */
+#  define DRM_DMG_CACHE_CAPACITY 32	/* Flushed areas remembered to bring older buffers up to date */
+#  define DRM_MAX_OUTPUTS   4	/* Connectors drm_init_outputs() drives, each gets its own lv_disp */
+#  define DRM_RENDER_SCALE  100	/* Render resolution in % of the mode, e.g. 50 to let the plane upscale */
+#  define DRM_ROTATION      0	/* 0, 90, 180 or 270: rotated by the plane if it can, LVGL's `rotated` matches */
+#  define DRM_VBLANK_MARGIN_US 1000	/* drm_get_sleep_us() plans frames to be ready this early */
+#  define DRM_HOTPLUG       0	/* Follow monitors being plugged and replaced through kernel uevents */
+#  define DRM_FLIP_STATS    0	/* Frame latency and missed vblanks, see drm_output_get_flip_stats() */
+#  define DRM_FLIP_LOG      64	/* Shown frames DRM_FLIP_STATS keeps timestamps of, 0: none */
+#  define DRM_CAPTURE       0	/* Capture the scanned out frames with a writeback connector, see drm_output_start_capture() */
+#  define DRM_MAX_LAYERS    2	/* Displays on overlay planes per output, see drm_output_create_layer() */
 #endif
 
 /*********************